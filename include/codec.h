@@ -9,17 +9,95 @@
 
 #pragma once
 
-#include "V4l2Output.h"
+#include "sink.h"
+#include "framestamp.h"
+#include "roimap.h"
+#include "codecoption.h"
+
+// planes of an I420 picture
+struct I420Frame {
+        I420Frame(uint8_t* y = NULL, uint8_t* u = NULL, uint8_t* v = NULL, int width = 0, int height = 0)
+            : y(y), u(u), v(v), strideY(width), strideUV((width+1)/2), width(width), height(height) {}
+
+        uint8_t* y;
+        uint8_t* u;
+        uint8_t* v;
+        int      strideY;
+        int      strideUV;
+        int      width;
+        int      height;
+};
+
 class Codec {
     public:
-        Codec(int format, int width, int height): m_informat(format), m_width(width), m_height(height) {}
+        Codec(int format, int width, int height): m_informat(format), m_width(width), m_height(height), m_forceKeyFrame(false), m_hasStamp(false), m_hasRoi(false) {}
         virtual ~Codec() {}
 
-        virtual void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) = 0;
+        virtual void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) = 0;
+
+        // a codec that failed to initialize is dropped by the factory
+        virtual bool isValid() { return true; }
+
+        // options declared by a codec, none by default
+        static const std::vector<CodecOption> & Options() {
+                static const std::vector<CodecOption> options;
+                return options;
+        }
+
+        // next encoded frame will be a keyframe with its parameter sets
+        void forceKeyFrame() { m_forceKeyFrame = true; }
+
+        // stamp to carry in the next encoded frame (SEI, COM marker)
+        void setFrameStamp(const FrameStamp & stamp) { m_stamp = stamp; m_hasStamp = true; }
+
+        // quantizer offsets of the regions of interest of the next frame
+        void setRoiMap(const RoiMap & roi) { m_roi = roi; m_hasRoi = true; }
+
+        // encoders reading I420 give the planes of their next picture, it is encoded by encode()
+        virtual bool getInputFrame(I420Frame &) { return false; }
+        virtual void encode(Sink*) {}
+
+        // decoders write the picture into I420 planes, scaled when its size differs
+        virtual bool decode(const char*, unsigned int, const I420Frame &) { return false; }
+
+        // options of the codec as checked by the factory
+        void setConfig(const std::vector<CodecOption> & options, const CodecConfig & config) { m_options = options; m_config = config; }
+        const CodecConfig & getConfig() { return m_config; }
+
+        // change an option while encoding, only the runtime ones are accepted
+        virtual bool setOption(const std::string & name, const std::string & value) {
+                const CodecOption* option = CodecOption::find(m_options, name);
+                if (!option || !option->runtime) {
+                        LOG(WARN) << "Option " << name << " cannot be changed at runtime";
+                        return false;
+                }
+                CodecConfig config = m_config;
+                std::string error;
+                if (!option->set(value, config, error)) {
+                        LOG(WARN) << "Invalid option " << name << "=" << value << " : " << error;
+                        return false;
+                }
+                if (!this->reconfigure(config)) {
+                        return false;
+                }
+                m_config = config;
+                return true;
+        }
+
+    protected:
+        // apply runtime options
+        virtual bool reconfigure(const CodecConfig &) { return false; }
 
     protected:
         int m_informat;
     	int m_width;
 		int m_height;
+		bool m_forceKeyFrame;
+		FrameStamp m_stamp;
+		bool m_hasStamp;
+		RoiMap m_roi;
+		bool m_hasRoi;
+		std::vector<CodecOption> m_options;
+		CodecConfig m_config;
 };
 
@@ -0,0 +1,70 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** codecchain.h
+**
+** Decode -> (scale) -> encode through I420 :
+**  - the decoder writes in the input planes of the encoder when it has some
+**  - otherwise the encoder converts the I420 picture of the chain
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <vector>
+
+#include "logger.h"
+#include "codec.h"
+
+class CodecChain : public Codec {
+    public:
+        // the chain owns its stages, the encoder reads V4L2_PIX_FMT_YUV420
+        CodecChain(Codec* decoder, Codec* encoder, int informat, int width, int height)
+            : Codec(informat, width, height), m_decoder(decoder), m_encoder(encoder) {}
+
+        virtual ~CodecChain() {
+                delete m_encoder;
+                delete m_decoder;
+        }
+
+        void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
+                // requests of the frame go to the encoder
+                if (m_forceKeyFrame) {
+                        m_encoder->forceKeyFrame();
+                        m_forceKeyFrame = false;
+                }
+                if (m_hasStamp) {
+                        m_encoder->setFrameStamp(m_stamp);
+                        m_hasStamp = false;
+                }
+                if (m_hasRoi) {
+                        m_encoder->setRoiMap(m_roi);
+                        m_hasRoi = false;
+                }
+
+                I420Frame frame;
+                if (m_encoder->getInputFrame(frame)) {
+                        if (m_decoder->decode(buffer, rsize, frame)) {
+                                m_encoder->encode(sink);
+                        }
+                } else {
+                        m_i420.resize(m_width*m_height + 2*((m_width+1)/2)*((m_height+1)/2));
+                        frame = I420Frame(m_i420.data(), m_i420.data() + m_width*m_height, m_i420.data() + m_width*m_height + ((m_width+1)/2)*((m_height+1)/2), m_width, m_height);
+                        if (m_decoder->decode(buffer, rsize, frame)) {
+                                m_encoder->convertAndWrite((const char*)m_i420.data(), m_i420.size(), sink);
+                        }
+                }
+        }
+
+        // options apply to the encoder
+        bool setOption(const std::string & name, const std::string & value) {
+                return m_encoder->setOption(name, value);
+        }
+
+    protected:
+        Codec*               m_decoder;
+        Codec*               m_encoder;
+        std::vector<uint8_t> m_i420;
+};
@@ -4,38 +4,94 @@
 ** any purpose.
 **
 ** codecfacotry.h
-** 
+**
+** Several implementations can register the same format, they are tried by
+** priority unless one is selected by name (option ENCODER or DECODER), an
+** implementation that fails to initialize is skipped.
+** With the name "auto" the candidates encode a few synthetic frames and the
+** fastest one that fits the frame budget (option FPS, default 25) is kept.
+** A compressed input with an encoder for the output format builds a chain
+** decoder -> encoder that shares the I420 planes of the encoder.
+** Options are checked against the schema of the created codec, an option
+** that no codec declares is refused.
+**
 ** -------------------------------------------------------------------------*/
 
 #pragma once
 
 #include <map>
+#include <list>
+#include <string>
+#include <vector>
+#include <chrono>
 
+#include "logger.h"
+#include "V4l2Device.h"
 #include "codec.h"
+#include "codecchain.h"
+#include "patterngenerator.h"
 
-typedef Codec* (*codecCreator)(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose);
+typedef Codec* (*codecCreator)(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose);
+typedef const std::vector<CodecOption> & (*codecOptions)();
 
 template<typename T> class CodecCreator {
         public:
-                static Codec* Create(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
-                        return new T(outformat, informat, width, height, opt, verbose);
+                static Codec* Create(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose) {
+                        return new T(outformat, informat, width, height, config, verbose);
                 }
+                static const std::vector<CodecOption> & Options() {
+                        return T::Options();
+                }
+};
+
+struct CodecEntry {
+        std::string  name;
+        int          priority;
+        codecCreator creator;
+        codecOptions options;
+};
+
+// count what a codec writes during a benchmark
+class NullSink : public Sink {
+    public:
+        NullSink(int format, int width, int height) : Sink(format, width, height), m_size(0) {}
+
+        virtual int write(const char*, unsigned int size, const FrameInfo &) {
+                m_size += size;
+                return size;
+        }
+
+        unsigned long long m_size;
 };
 
 class CodecFactory {
     public:
         Codec* Create(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
                 Codec* convertor = NULL;
+                if (!this->checkOptions(opt)) {
+                        return NULL;
+                }
                 auto itDecoder = m_registryDecoder.find(informat);
-                if (itDecoder != std::end(m_registryDecoder)) {
-                        convertor = itDecoder->second(outformat, informat, width, height, opt, verbose);
+                auto itOutput = m_registryEncoder.find(outformat);
+                if ( (itDecoder != std::end(m_registryDecoder)) && (itOutput != std::end(m_registryEncoder)) ) {
+                        // compressed to compressed goes through the I420 planes of the encoder
+                        Codec* decoder = this->select(itDecoder->second, "DECODER", V4L2_PIX_FMT_YUV420, informat, width, height, opt, verbose, false);
+                        Codec* encoder = decoder ? this->select(itOutput->second, "ENCODER", outformat, V4L2_PIX_FMT_YUV420, width, height, opt, verbose, true) : NULL;
+                        if (decoder && encoder) {
+                                convertor = new CodecChain(decoder, encoder, informat, width, height);
+                        } else {
+                                delete encoder;
+                                delete decoder;
+                        }
+                } else if (itDecoder != std::end(m_registryDecoder)) {
+                        convertor = this->select(itDecoder->second, "DECODER", outformat, informat, width, height, opt, verbose, false);
                 } else {
                         auto itEncoder = m_registryEncoder.find(outformat);
                         if (itEncoder == std::end(m_registryEncoder)) {
                                 itEncoder = m_registryEncoder.find(0);
                         }
                         if (itEncoder != std::end(m_registryEncoder)) {
-                                convertor = itEncoder->second(outformat, informat, width, height, opt, verbose);
+                                convertor = this->select(itEncoder->second, "ENCODER", outformat, informat, width, height, opt, verbose, true);
                         }
                 }
                 return convertor;
@@ -46,7 +102,40 @@ class CodecFactory {
                 for (auto it : m_registryEncoder) {
                         formatList.push_back(it.first);
                 }
-                return formatList;      
+                return formatList;
+        }
+
+        // names of the encoders of a format by priority
+        std::list<std::string> SupportedEncoder(int format) {
+                std::list<std::string> nameList;
+                auto it = m_registryEncoder.find(format);
+                if (it != std::end(m_registryEncoder)) {
+                        for (const CodecEntry & entry : it->second) {
+                                nameList.push_back(entry.name);
+                        }
+                }
+                return nameList;
+        }
+
+        // options of each implementation
+        std::list<std::pair<std::string, CodecOption> > SupportedOption() {
+                std::list<std::pair<std::string, CodecOption> > optionList;
+                for (auto registry : { &m_registryEncoder, &m_registryDecoder }) {
+                        for (auto & it : *registry) {
+                                for (const CodecEntry & entry : it.second) {
+                                        for (const CodecOption & option : entry.options()) {
+                                                bool found = false;
+                                                for (auto & known : optionList) {
+                                                        found = found || ( (known.first == entry.name) && (std::string(known.second.name) == option.name) );
+                                                }
+                                                if (!found) {
+                                                        optionList.push_back(std::make_pair(entry.name, option));
+                                                }
+                                        }
+                                }
+                        }
+                }
+                return optionList;
         }
 
         static CodecFactory & get() {
@@ -54,16 +143,162 @@ class CodecFactory {
                 return instance;
         }
 
-        bool registerEncoder(int format, codecCreator creator) {
-                m_registryEncoder[format] = creator;
-                return true;
+        bool registerEncoder(int format, codecCreator creator, codecOptions options, const std::string & name = "", int priority = 0) {
+                return this->add(m_registryEncoder[format], creator, options, name, priority);
+        }
+
+        bool registerDecoder(int format, codecCreator creator, codecOptions options, const std::string & name = "", int priority = 0) {
+                return this->add(m_registryDecoder[format], creator, options, name, priority);
         }
 
-        bool registerDecoder(int format, codecCreator creator) {
-                m_registryDecoder[format] = creator;
+    private:
+        // keep the list sorted by priority, first registered first for the same priority
+        bool add(std::list<CodecEntry> & entries, codecCreator creator, codecOptions options, const std::string & name, int priority) {
+                auto it = entries.begin();
+                while ( (it != entries.end()) && (it->priority >= priority) ) {
+                        ++it;
+                }
+                CodecEntry entry = { name, priority, creator, options };
+                entries.insert(it, entry);
                 return true;
         }
+
+        // options of the factory itself or declared by a codec, a typo is reported before creating anything
+        bool checkOptions(const std::map<std::string,std::string> & opt) {
+                bool valid = true;
+                for (auto & it : opt) {
+                        if ( (it.first == "ENCODER") || (it.first == "DECODER") ) {
+                                continue;
+                        }
+                        if (it.first == "FPS") {
+                                char* end = NULL;
+                                long fps = strtol(it.second.c_str(), &end, 10);
+                                if ( it.second.empty() || (*end != '\0') || (fps <= 0) ) {
+                                        LOG(ERROR) << "Invalid option FPS=" << it.second;
+                                        valid = false;
+                                }
+                                continue;
+                        }
+                        bool known = false;
+                        for (auto & option : this->SupportedOption()) {
+                                known = known || (it.first == option.second.name);
+                        }
+                        if (!known) {
+                                LOG(ERROR) << "Unknown codec option " << it.first;
+                                valid = false;
+                        }
+                }
+                return valid;
+        }
+
+        // create an implementation with its typed options, warn about the options it does not use
+        Codec* create(const CodecEntry & entry, int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose, bool warn) {
+                const std::vector<CodecOption> & options = entry.options();
+                CodecConfig config = CodecOption::defaults(options);
+                for (auto & it : opt) {
+                        if ( (it.first == "ENCODER") || (it.first == "DECODER") || (it.first == "FPS") ) {
+                                continue;
+                        }
+                        const CodecOption* option = CodecOption::find(options, it.first);
+                        if (!option) {
+                                if (warn) {
+                                        LOG(WARN) << "Option " << it.first << " is not supported by " << entry.name << ", ignored";
+                                }
+                                continue;
+                        }
+                        std::string error;
+                        if (!option->set(it.second, config, error)) {
+                                LOG(ERROR) << "Invalid option " << it.first << "=" << it.second << " for " << entry.name << " : " << error;
+                                return NULL;
+                        }
+                }
+                Codec* codec = entry.creator(outformat, informat, width, height, config, verbose);
+                if (codec && !codec->isValid()) {
+                        LOG(WARN) << "Cannot initialize " << entry.name << " for " << V4l2Device::fourcc(informat) << "->" << V4l2Device::fourcc(outformat);
+                        delete codec;
+                        codec = NULL;
+                }
+                if (codec) {
+                        codec->setConfig(options, config);
+                }
+                return codec;
+        }
+
+        Codec* select(const std::list<CodecEntry> & entries, const std::string & key, int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose, bool warn) {
+                std::string name;
+                auto it = opt.find(key);
+                if (it != opt.end()) {
+                        name = it->second;
+                }
+                if (name == "auto") {
+                        return this->benchmark(entries, outformat, informat, width, height, opt, verbose, warn);
+                }
+                // without a name the next implementation is tried when one cannot be created
+                for (const CodecEntry & entry : entries) {
+                        if (name.empty() || (entry.name == name)) {
+                                LOG(INFO) << "Create " << entry.name << " for " << V4l2Device::fourcc(informat) << "->" << V4l2Device::fourcc(outformat);
+                                Codec* codec = this->create(entry, outformat, informat, width, height, opt, verbose, warn);
+                                if (codec || !name.empty()) {
+                                        return codec;
+                                }
+                        }
+                }
+                LOG(WARN) << "No implementation " << name << " for " << V4l2Device::fourcc(informat) << "->" << V4l2Device::fourcc(outformat);
+                return NULL;
+        }
+
+        // time each candidate on the same frames, the ones that write nothing are not working
+        Codec* benchmark(const std::list<CodecEntry> & entries, int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose, bool warn) {
+                const CodecEntry* best = entries.empty() ? NULL : &entries.front();
+                PatternGenerator generator(informat, width, height, "bars,box,counter");
+                if ( (entries.size() > 1) && generator.isValid() && (generator.getWidth() == width) && (generator.getHeight() == height) ) {
+                        int fps = 25;
+                        auto it = opt.find("FPS");
+                        if (it != opt.end()) {
+                                fps = std::stoi(it->second);
+                        }
+                        const double budget = 1000000.0 / fps;
+                        const unsigned int warmup = 2;
+                        const unsigned int frames = 10;
+                        double bestTime = 0;
+                        best = NULL;
+                        for (const CodecEntry & entry : entries) {
+                                Codec* codec = this->create(entry, outformat, informat, width, height, opt, verbose, false);
+                                if (!codec) {
+                                        continue;
+                                }
+                                NullSink sink(outformat, width, height);
+                                std::chrono::steady_clock::time_point start;
+                                for (unsigned int i = 0; i < warmup + frames; ++i) {
+                                        if (i == warmup) {
+                                                start = std::chrono::steady_clock::now();
+                                        }
+                                        codec->convertAndWrite(generator.getFrame(i), generator.getSize(), &sink);
+                                }
+                                std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                                delete codec;
+
+                                double frameTime = elapsed.count() / frames;
+                                LOG(NOTICE) << "Benchmark " << entry.name << " " << V4l2Device::fourcc(outformat) << " " << width << "x" << height
+                                            << " " << (int)frameTime << "us/frame (budget " << (int)budget << "us) output:" << sink.m_size;
+                                if ( (sink.m_size > 0) && ( (best == NULL) || (frameTime < bestTime) ) ) {
+                                        best = &entry;
+                                        bestTime = frameTime;
+                                }
+                        }
+                        if (best && (bestTime > budget)) {
+                                LOG(WARN) << "No implementation of " << V4l2Device::fourcc(outformat) << " fits the budget of " << fps << " fps";
+                        }
+                }
+                if (!best) {
+                        LOG(WARN) << "No working implementation for " << V4l2Device::fourcc(informat) << "->" << V4l2Device::fourcc(outformat);
+                        return NULL;
+                }
+                LOG(NOTICE) << "Select " << best->name << " for " << V4l2Device::fourcc(informat) << "->" << V4l2Device::fourcc(outformat);
+                return this->create(*best, outformat, informat, width, height, opt, verbose, warn);
+        }
+
     private:
-        std::map<int, codecCreator> m_registryEncoder;
-        std::map<int, codecCreator> m_registryDecoder;
+        std::map<int, std::list<CodecEntry> > m_registryEncoder;
+        std::map<int, std::list<CodecEntry> > m_registryDecoder;
 };
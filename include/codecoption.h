@@ -0,0 +1,113 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** codecoption.h
+**
+** Each codec declares the options it understands (name, type, range,
+** default, runtime change allowed), the factory checks the key=value
+** options against them once and gives a CodecConfig to the constructor.
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// values of the options, -1 when an option is not set
+struct CodecConfig {
+        CodecConfig() : gop(-1), cbr(-1), vbr(-1), cqp(-1), crf(-1), intraRefresh(false), scenecut(-1), roi(false), quality(-1), dri(-1) {}
+
+        int  gop;           // GOP           : keyframe interval
+        int  cbr;           // CBR           : constant bitrate (kbps)
+        int  vbr;           // VBR           : variable bitrate (kbps)
+        int  cqp;           // RC_CQP        : constant quantizer
+        int  crf;           // RC_CRF        : constant rate factor
+        bool intraRefresh;  // INTRA_REFRESH : periodic intra refresh instead of keyframes
+        int  scenecut;      // SCENECUT      : keyframes on scene changes
+        bool roi;           // ROI           : quantizer offsets of RoiMap are applied
+        int  quality;       // QUALITY       : JPEG quality
+        int  dri;           // DRI           : JPEG restart interval
+};
+
+struct CodecOption {
+        enum Type { INTEGER, BOOLEAN };
+
+        static CodecOption Integer(const char* name, int CodecConfig::* value, int min, int max, int defaultValue, bool runtime, const char* help) {
+                CodecOption option = { name, INTEGER, min, max, defaultValue, runtime, help, value, NULL };
+                return option;
+        }
+
+        static CodecOption Boolean(const char* name, bool CodecConfig::* value, bool defaultValue, bool runtime, const char* help) {
+                CodecOption option = { name, BOOLEAN, 0, 1, defaultValue, runtime, help, NULL, value };
+                return option;
+        }
+
+        static const CodecOption* find(const std::vector<CodecOption> & options, const std::string & name) {
+                for (const CodecOption & option : options) {
+                        if (name == option.name) {
+                                return &option;
+                        }
+                }
+                return NULL;
+        }
+
+        // values of the options that are not given
+        static CodecConfig defaults(const std::vector<CodecOption> & options) {
+                CodecConfig config;
+                for (const CodecOption & option : options) {
+                        if (option.type == BOOLEAN) {
+                                config.*option.boolValue = option.defaultValue;
+                        } else {
+                                config.*option.intValue = option.defaultValue;
+                        }
+                }
+                return config;
+        }
+
+        // parse and check the value, config is unchanged on error
+        bool set(const std::string & value, CodecConfig & config, std::string & error) const {
+                if (type == BOOLEAN) {
+                        std::string lower(value);
+                        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+                        if ( (lower == "1") || (lower == "true") || (lower == "yes") || (lower == "on") ) {
+                                config.*boolValue = true;
+                        } else if ( (lower == "0") || (lower == "false") || (lower == "no") || (lower == "off") ) {
+                                config.*boolValue = false;
+                        } else {
+                                error = "expect a boolean";
+                                return false;
+                        }
+                        return true;
+                }
+                char* end = NULL;
+                errno = 0;
+                long number = strtol(value.c_str(), &end, 10);
+                if ( value.empty() || (*end != '\0') || (errno != 0) ) {
+                        error = "expect an integer";
+                        return false;
+                }
+                if ( (number < min) || (number > max) ) {
+                        error = "out of range [" + std::to_string(min) + ".." + std::to_string(max) + "]";
+                        return false;
+                }
+                config.*intValue = number;
+                return true;
+        }
+
+        const char*         name;
+        Type                type;
+        int                 min;
+        int                 max;
+        int                 defaultValue;   // -1 leaves an integer unset
+        bool                runtime;        // can be changed with Codec::setOption
+        const char*         help;
+        int  CodecConfig::* intValue;
+        bool CodecConfig::* boolValue;
+};
@@ -9,13 +9,16 @@
 
 #pragma once
 
+#include "libyuv.h"
+#include "logger.h"
 #include "codecfactory.h"
 
 #include <cuda.h>
 #include "nvEncodeAPI.h"
 
 inline bool check(int e, int iLine, const char *szFile) {
-    if (e < 0) {
+    // CUDA and NVENC report errors as non zero status
+    if (e != 0) {
         LOG(ERROR) << "General error " << e << " at line " << iLine << " in file " << szFile;
         return false;
     }
@@ -26,39 +29,44 @@ inline bool check(int e, int iLine, const char *szFile) {
 
 class CudaEncoder : public Codec {
     public:
-        CudaEncoder(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose)
-            : Codec(informat, width, height) {
-            ck(cuInit(0));
+        CudaEncoder(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose)
+            : Codec(informat, width, height), m_cuContext(NULL), m_valid(false) {
+            m_inputBuffer.inputBuffer = NULL;
+            m_outputBuffer.bitstreamBuffer = NULL;
+
+            // each step runs only when the previous ones succeeded, the factory drops an invalid encoder
+            m_valid = ck(cuInit(0));
             int nGpu = 0;
-            ck(cuDeviceGetCount(&nGpu));  
-            std::cout << "Nb GPU: " << nGpu << std::endl;          
+            m_valid = m_valid && ck(cuDeviceGetCount(&nGpu)) && (nGpu > 0);
+            LOG(NOTICE) << "Nb GPU: " << nGpu;
 
             int iGpu = 0;
             CUdevice cuDevice = 0;
-            ck(cuDeviceGet(&cuDevice, iGpu));
-            char szDeviceName[80];
-            ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
-            std::cout << "GPU in use: " << szDeviceName << std::endl;
-            ck(cuCtxCreate(&m_cuContext, 0, cuDevice));
-            ck(cuCtxPopCurrent(&m_cuContext));
+            char szDeviceName[80] = "";
+            m_valid = m_valid && ck(cuDeviceGet(&cuDevice, iGpu));
+            m_valid = m_valid && ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
+            LOG(NOTICE) << "GPU in use: " << szDeviceName;
+            m_valid = m_valid && ck(cuCtxCreate(&m_cuContext, 0, cuDevice));
+            m_valid = m_valid && ck(cuCtxPopCurrent(&m_cuContext));
 
             // create api
             uint32_t version = 0;
-            ck(NvEncodeAPIGetMaxSupportedVersion(&version));
+            m_valid = m_valid && ck(NvEncodeAPIGetMaxSupportedVersion(&version));
             uint32_t currentVersion = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
-            if (currentVersion > version)
+            if (m_valid && (currentVersion > version))
             {
-                std::cout << "Current Driver Version does not support this NvEncodeAPI version, please upgrade driver:" << NV_ENC_ERR_INVALID_VERSION << std::endl;
+                LOG(ERROR) << "Current Driver Version does not support this NvEncodeAPI version, please upgrade driver:" << NV_ENC_ERR_INVALID_VERSION;
+                m_valid = false;
             }
             m_nvenc = { NV_ENCODE_API_FUNCTION_LIST_VER };
-            ck(NvEncodeAPICreateInstance(&m_nvenc));
+            m_valid = m_valid && ck(NvEncodeAPICreateInstance(&m_nvenc));
 
             // create encoder
             NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS encodeSessionExParams = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER };
             encodeSessionExParams.device = m_cuContext;
             encodeSessionExParams.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
             encodeSessionExParams.apiVersion = NVENCAPI_VERSION;
-            ck(m_nvenc.nvEncOpenEncodeSessionEx(&encodeSessionExParams, &m_hEncoder));
+            m_valid = m_valid && ck(m_nvenc.nvEncOpenEncodeSessionEx(&encodeSessionExParams, &m_hEncoder));
 
             // init encoder
             NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
@@ -71,10 +79,10 @@ class CudaEncoder : public Codec {
 
             NV_ENC_PRESET_CONFIG presetcfg = { NV_ENC_PRESET_CONFIG_VER };
             presetcfg.presetCfg.version = NV_ENC_CONFIG_VER;
-            ck(m_nvenc.nvEncGetEncodePresetConfig(m_hEncoder, initializeParams.encodeGUID, initializeParams.presetGUID, &presetcfg));
+            m_valid = m_valid && ck(m_nvenc.nvEncGetEncodePresetConfig(m_hEncoder, initializeParams.encodeGUID, initializeParams.presetGUID, &presetcfg));
             memcpy(&encodeConfig, &presetcfg, sizeof(NV_ENC_CONFIG));
 
-            ck(m_nvenc.nvEncInitializeEncoder(m_hEncoder, &initializeParams));
+            m_valid = m_valid && ck(m_nvenc.nvEncInitializeEncoder(m_hEncoder, &initializeParams));
 
             // create inputbuffer
             m_inputBuffer.version    = NV_ENC_CREATE_INPUT_BUFFER_VER;
@@ -82,27 +90,52 @@ class CudaEncoder : public Codec {
             m_inputBuffer.height     = m_height;
             m_inputBuffer.memoryHeap = NV_ENC_MEMORY_HEAP_SYSMEM_CACHED;
             m_inputBuffer.bufferFmt  = NV_ENC_BUFFER_FORMAT_IYUV;
-            ck(m_nvenc.nvEncCreateInputBuffer(m_hEncoder,&m_inputBuffer));
+            m_valid = m_valid && ck(m_nvenc.nvEncCreateInputBuffer(m_hEncoder,&m_inputBuffer));
 
             // create outputbuffer
             m_outputBuffer.version    = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
             m_outputBuffer.size       = 2 * 1024 * 1024;  // No idea why
             m_outputBuffer.memoryHeap = NV_ENC_MEMORY_HEAP_SYSMEM_CACHED;
-            ck(m_nvenc.nvEncCreateBitstreamBuffer(m_hEncoder, &m_outputBuffer));
+            m_valid = m_valid && ck(m_nvenc.nvEncCreateBitstreamBuffer(m_hEncoder, &m_outputBuffer));
         }
 
         virtual ~CudaEncoder() {
-            m_nvenc.nvEncDestroyEncoder(m_hEncoder);
-            cuCtxDestroy(m_cuContext);
+            if (m_hEncoder) {
+                if (m_inputBuffer.inputBuffer) {
+                    m_nvenc.nvEncDestroyInputBuffer(m_hEncoder, m_inputBuffer.inputBuffer);
+                }
+                if (m_outputBuffer.bitstreamBuffer) {
+                    m_nvenc.nvEncDestroyBitstreamBuffer(m_hEncoder, m_outputBuffer.bitstreamBuffer);
+                }
+                m_nvenc.nvEncDestroyEncoder(m_hEncoder);
+            }
+            if (m_cuContext) {
+                cuCtxDestroy(m_cuContext);
+            }
         }
 
-        virtual void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) {
+        bool isValid() { return m_valid; }
 
-            // fill inputbuffer
+        virtual void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
+
+            // convert into the IYUV input buffer, planes follow each other with the pitch of the lock
             NV_ENC_LOCK_INPUT_BUFFER inputbufferlocker = { NV_ENC_LOCK_INPUT_BUFFER_VER };
             inputbufferlocker.inputBuffer = m_inputBuffer.inputBuffer;
-            ck(m_nvenc.nvEncLockInputBuffer(m_hEncoder, &inputbufferlocker));
-            memcpy((void*)inputbufferlocker.bufferDataPtr, buffer, rsize);
+            if (!ck(m_nvenc.nvEncLockInputBuffer(m_hEncoder, &inputbufferlocker))) {
+                return;
+            }
+            int pitch = inputbufferlocker.pitch;
+            uint8_t* y = (uint8_t*)inputbufferlocker.bufferDataPtr;
+            uint8_t* u = y + pitch*m_height;
+            uint8_t* v = u + (pitch/2)*((m_height+1)/2);
+            libyuv::ConvertToI420((const uint8_t*)buffer, rsize,
+                    y, pitch,
+                    u, pitch/2,
+                    v, pitch/2,
+                    0, 0,
+                    m_width, m_height,
+                    m_width, m_height,
+                    libyuv::kRotate0, m_informat);
             ck(m_nvenc.nvEncUnlockInputBuffer(m_hEncoder, &inputbufferlocker));
 
             // encode
@@ -111,13 +144,18 @@ class CudaEncoder : public Codec {
             picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
             picParams.inputBuffer = m_inputBuffer.inputBuffer;
             picParams.outputBitstream = m_outputBuffer.bitstreamBuffer;
+            if (m_forceKeyFrame) {
+                picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+                m_forceKeyFrame = false;
+            }
             NVENCSTATUS nvStatus = m_nvenc.nvEncEncodePicture(m_hEncoder, &picParams);
 
             // retrieve encoded data from outputbuffer
             NV_ENC_LOCK_BITSTREAM outputbufferlocker = { NV_ENC_LOCK_BITSTREAM_VER };
             outputbufferlocker.outputBitstream = m_outputBuffer.bitstreamBuffer;
             m_nvenc.nvEncLockBitstream(m_hEncoder, &outputbufferlocker);
-            int wsize = videoOutput->write((char*)outputbufferlocker.bitstreamBufferPtr, outputbufferlocker.bitstreamSizeInBytes);
+            FrameInfo info(outputbufferlocker.pictureType == NV_ENC_PIC_TYPE_IDR);
+            int wsize = sink->write((char*)outputbufferlocker.bitstreamBufferPtr, outputbufferlocker.bitstreamSizeInBytes, info);
             LOG(DEBUG) << "Copied " << rsize << " " << wsize;           
             m_nvenc.nvEncUnlockBitstream(m_hEncoder, &outputbufferlocker);
 
@@ -129,9 +167,10 @@ class CudaEncoder : public Codec {
         void *m_hEncoder = nullptr;
         NV_ENC_CREATE_INPUT_BUFFER m_inputBuffer;
         NV_ENC_CREATE_BITSTREAM_BUFFER m_outputBuffer;
+        bool m_valid;
 
 	public:
 		static const bool registration;        
 };
 
-const bool CudaEncoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_H264, CodecCreator<CudaEncoder>::Create);
+const bool CudaEncoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_H264, CodecCreator<CudaEncoder>::Create, CodecCreator<CudaEncoder>::Options, "nvenc", 40);
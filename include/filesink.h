@@ -0,0 +1,228 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** filesink.h
+**
+** Write frames to segmented files :
+**  - H264/HEVC : Annex-B elementary stream
+**  - VP8/VP9   : IVF
+**  - JPEG      : concatenated MJPEG
+**  - others    : raw frames
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <algorithm>
+#include <sys/uio.h>
+
+#include "logger.h"
+#include "sinkfactory.h"
+#include "filewriter.h"
+
+class FileSink : public Sink {
+    public:
+        // opt SEGMENT_DURATION in seconds, SEGMENT_SIZE in bytes, a new segment starts on the next keyframe once a limit is reached
+        //     WRITE_BUFFER in bytes is the size of the buffer between the caller and the writer thread
+        static Sink* create(const std::string & path, int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
+                unsigned long long duration = 0;
+                unsigned long long size = 0;
+                unsigned long long bufferSize = 16*1024*1024;
+                if ( !SinkFactory::getOption(opt, "SEGMENT_DURATION", 0, 365*24*3600ULL, duration)
+                  || !SinkFactory::getOption(opt, "SEGMENT_SIZE", 0, ULLONG_MAX, size)
+                  || !SinkFactory::getOption(opt, "WRITE_BUFFER", 1, 1024*1024*1024ULL, bufferSize) ) {
+                        return NULL;
+                }
+                return new FileSink(path, format, width, height, duration, size, bufferSize);
+        }
+
+        FileSink(const std::string & path, int format, int width, int height, unsigned long segmentDuration, unsigned long long segmentSize, size_t bufferSize)
+            : Sink(format, width, height), m_path(path), m_segmentDuration(segmentDuration), m_segmentSize(segmentSize)
+            , m_writer(bufferSize), m_opened(false), m_waitKeyFrame(false), m_failed(false), m_index(0), m_size(0), m_previousSize(0), m_start(0), m_frameCount(0) {}
+
+        virtual ~FileSink() {
+                this->closeSegment();
+        }
+
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo & info) {
+                bool keyframe = info.keyframe || !this->isInterFrameCodec();
+                if (m_opened && m_writer.hasError()) {
+                        // the writer thread could not open or write the segment, it is opened again on the next keyframe
+                        LOG(WARN) << "Cannot write segment, retry on next keyframe";
+                        this->closeSegment();
+                        m_failed = true;
+                }
+                if (!m_opened || (keyframe && this->isSegmentFull())) {
+                        if (!keyframe) {
+                                // a segment should start with a keyframe
+                                return m_failed ? -1 : 0;
+                        }
+                        m_failed = !this->openSegment();
+                        if (m_failed) {
+                                return -1;
+                        }
+                }
+                if (m_waitKeyFrame) {
+                        if (!keyframe) {
+                                return 0;
+                        }
+                        m_waitKeyFrame = false;
+                }
+
+                struct iovec iov[2];
+                int iovcnt = 0;
+                unsigned char frameHeader[12];
+                if (this->isIvf()) {
+                        // IVF frame header : size, pts in milliseconds
+                        setLE(frameHeader, size, 4);
+                        setLE(frameHeader+4, (now() - m_start) / 1000, 8);
+                        iov[iovcnt].iov_base = frameHeader;
+                        iov[iovcnt].iov_len = sizeof(frameHeader);
+                        iovcnt++;
+                }
+                iov[iovcnt].iov_base = (void*)buffer;
+                iov[iovcnt].iov_len = size;
+                iovcnt++;
+
+                int wsize = -1;
+                if (m_writer.write(iov, iovcnt)) {
+                        wsize = size;
+                        for (int i=0; i<iovcnt; ++i) {
+                                m_size += iov[i].iov_len;
+                        }
+                        m_frameCount++;
+                } else {
+                        // dropping a frame breaks the references until the next keyframe
+                        m_waitKeyFrame = true;
+                }
+                return wsize;
+        }
+
+    protected:
+        bool isIvf() {
+                return (m_format == V4L2_PIX_FMT_VP8) || (m_format == V4L2_PIX_FMT_VP9);
+        }
+
+        bool isInterFrameCodec() {
+                return (m_format == V4L2_PIX_FMT_H264) || (m_format == V4L2_PIX_FMT_HEVC) || this->isIvf();
+        }
+
+        bool isSegmentFull() {
+                bool full = false;
+                if ( m_segmentDuration && ((now() - m_start) >= m_segmentDuration*1000000ULL) ) {
+                        full = true;
+                }
+                if ( m_segmentSize && (m_size >= m_segmentSize) ) {
+                        full = true;
+                }
+                return full;
+        }
+
+        // strftime is applied on path containing %, otherwise segments are numbered before the extension
+        std::string segmentName() {
+                std::string name = m_path;
+                if (m_path.find('%') != std::string::npos) {
+                        char buf[1024];
+                        time_t t = time(NULL);
+                        struct tm tm;
+                        localtime_r(&t, &tm);
+                        if (strftime(buf, sizeof(buf), m_path.c_str(), &tm) > 0) {
+                                name = buf;
+                        }
+                } else if (m_segmentDuration || m_segmentSize) {
+                        char index[16];
+                        snprintf(index, sizeof(index), "-%05u", m_index);
+                        size_t dot = name.find_last_of('.');
+                        size_t slash = name.find_last_of('/');
+                        if ( (dot == std::string::npos) || ((slash != std::string::npos) && (dot < slash)) ) {
+                                dot = name.size();
+                        }
+                        name.insert(dot, index);
+                }
+                return name;
+        }
+
+        bool openSegment() {
+                this->closeSegment();
+
+                // preallocate the expected segment size to limit fragmentation and metadata updates
+                std::string name = this->segmentName();
+                if (!m_writer.open(name, std::max(m_segmentSize, m_previousSize))) {
+                        return false;
+                }
+                LOG(NOTICE) << "Start segment " << name;
+                m_opened = true;
+                m_waitKeyFrame = false;
+                m_index++;
+                m_size = 0;
+                m_frameCount = 0;
+                m_start = now();
+
+                if (this->isIvf()) {
+                        unsigned char header[32];
+                        memset(header, 0, sizeof(header));
+                        memcpy(header, "DKIF", 4);
+                        setLE(header+6, sizeof(header), 2);
+                        setLE(header+8, m_format, 4);
+                        setLE(header+12, m_width, 2);
+                        setLE(header+14, m_height, 2);
+                        setLE(header+16, 1000, 4);
+                        setLE(header+20, 1, 4);
+                        struct iovec iov = { header, sizeof(header) };
+                        m_writer.write(&iov, 1);
+                        m_size += sizeof(header);
+                }
+                return true;
+        }
+
+        void closeSegment() {
+                if (m_opened) {
+                        if (this->isIvf()) {
+                                // update frame count in the IVF header
+                                unsigned char count[4];
+                                setLE(count, m_frameCount, 4);
+                                m_writer.pwrite(count, sizeof(count), 24);
+                        }
+                        m_writer.close();
+                        m_opened = false;
+                        m_previousSize = m_size;
+                }
+        }
+
+        static void setLE(unsigned char* ptr, unsigned long long value, int nbBytes) {
+                for (int i=0; i<nbBytes; ++i) {
+                        ptr[i] = (value >> (8*i)) & 0xff;
+                }
+        }
+
+        // monotonic time in microseconds
+        static unsigned long long now() {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+        }
+
+    protected:
+        std::string         m_path;
+        unsigned long       m_segmentDuration;
+        unsigned long long  m_segmentSize;
+        FileWriter          m_writer;
+        bool                m_opened;
+        bool                m_waitKeyFrame;
+        bool                m_failed;
+        unsigned int        m_index;
+        unsigned long long  m_size;
+        unsigned long long  m_previousSize;
+        unsigned long long  m_start;
+        unsigned int        m_frameCount;
+
+    public:
+        static const bool registration;
+};
+
+const bool FileSink::registration = SinkFactory::get().registerSink("file", FileSink::create);
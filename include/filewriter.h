@@ -0,0 +1,308 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** filewriter.h
+**
+** Write files from a dedicated thread, data are copied in a pre-allocated ring
+** buffer so the caller never blocks on the filesystem
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "logger.h"
+
+class FileWriter {
+    public:
+        FileWriter(size_t bufferSize, size_t maxOperations = 1024)
+            : m_buffer(bufferSize), m_readPos(0), m_writePos(0), m_used(0)
+            , m_ops(maxOperations), m_opRead(0), m_opCount(0)
+            , m_stop(false), m_error(false), m_pendingOpens(0), m_fd(-1), m_offset(0), m_flushed(0), m_reserved(0) {
+                m_thread = std::thread(&FileWriter::run, this);
+        }
+
+        virtual ~FileWriter() {
+                this->close();
+                {
+                        std::unique_lock<std::mutex> lock(m_mutex);
+                        m_stop = true;
+                }
+                m_cond.notify_all();
+                m_thread.join();
+        }
+
+        // open a new file, space is reserved with fallocate without changing the file size
+        bool open(const std::string & name, unsigned long long preallocate) {
+                struct iovec iov = { (void*)name.c_str(), name.size() + 1 };
+                return this->push(OP_OPEN, &iov, 1, preallocate);
+        }
+
+        bool write(const struct iovec* iov, int iovcnt) {
+                return this->push(OP_WRITE, iov, iovcnt, 0);
+        }
+
+        bool pwrite(const void* data, size_t size, unsigned long long offset) {
+                struct iovec iov = { (void*)data, size };
+                return this->push(OP_PWRITE, &iov, 1, offset);
+        }
+
+        bool close() {
+                return this->push(OP_CLOSE, NULL, 0, 0);
+        }
+
+        // an open, write or pwrite of the current file failed in the writer thread, cleared by the next open
+        bool hasError() {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                return m_error;
+        }
+
+    protected:
+        enum OpType { OP_OPEN, OP_WRITE, OP_PWRITE, OP_CLOSE };
+
+        struct Operation {
+                OpType             type;
+                size_t             offset;     // position of the data in the ring buffer
+                size_t             size;       // size of the data
+                size_t             reserved;   // ring buffer space used including skipped tail
+                unsigned long long arg;        // preallocation or file offset
+        };
+
+        // copy data in the ring buffer and queue the operation, fails if the buffer is full
+        bool push(OpType type, const struct iovec* iov, int iovcnt, unsigned long long arg) {
+                size_t size = 0;
+                for (int i=0; i<iovcnt; ++i) {
+                        size += iov[i].iov_len;
+                }
+
+                std::unique_lock<std::mutex> lock(m_mutex);
+                Operation op = { type, 0, size, 0, arg };
+                if ( (m_opCount == m_ops.size()) || !this->reserve(op) ) {
+                        LOG(WARN) << "FileWriter buffer full, drop " << size << " bytes";
+                        return false;
+                }
+                lock.unlock();
+
+                // the reserved area is not accessed by the writer thread until the operation is queued
+                char* ptr = m_buffer.data() + op.offset;
+                for (int i=0; i<iovcnt; ++i) {
+                        memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+                        ptr += iov[i].iov_len;
+                }
+
+                lock.lock();
+                m_ops[(m_opRead + m_opCount) % m_ops.size()] = op;
+                m_opCount++;
+                if (type == OP_OPEN) {
+                        // errors of the previous file are no longer relevant
+                        m_error = false;
+                        m_pendingOpens++;
+                }
+                lock.unlock();
+                m_cond.notify_one();
+                return true;
+        }
+
+        // called with lock held
+        bool reserve(Operation & op) {
+                if (m_used == 0) {
+                        m_readPos = m_writePos = 0;
+                }
+                if ( (m_used > 0) && (m_writePos <= m_readPos) ) {
+                        // free space is between write and read position
+                        if (m_readPos - m_writePos < op.size) {
+                                return false;
+                        }
+                        op.offset = m_writePos;
+                        op.reserved = op.size;
+                } else if (m_buffer.size() - m_writePos >= op.size) {
+                        op.offset = m_writePos;
+                        op.reserved = op.size;
+                } else if (m_readPos >= op.size) {
+                        // skip the end of the buffer
+                        op.offset = 0;
+                        op.reserved = m_buffer.size() - m_writePos + op.size;
+                } else {
+                        return false;
+                }
+                m_writePos = op.offset + op.size;
+                m_used += op.reserved;
+                return true;
+        }
+
+        void run() {
+                std::vector<struct iovec> iov;
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (true) {
+                        m_cond.wait(lock, [this]{ return m_stop || (m_opCount > 0); });
+                        if (m_opCount == 0) {
+                                break;
+                        }
+
+                        // consecutive writes are merged in a single writev
+                        Operation op = m_ops[m_opRead];
+                        size_t nbOps = 1;
+                        size_t used = op.reserved;
+                        size_t end = op.offset + op.size;
+                        iov.assign(1, { m_buffer.data() + op.offset, op.size });
+                        if (op.type == OP_WRITE) {
+                                while ( (nbOps < m_opCount) && (iov.size() < IOV_MAX) ) {
+                                        const Operation & next = m_ops[(m_opRead + nbOps) % m_ops.size()];
+                                        if (next.type != OP_WRITE) {
+                                                break;
+                                        }
+                                        if (next.offset == end) {
+                                                iov.back().iov_len += next.size;
+                                        } else {
+                                                iov.push_back({ m_buffer.data() + next.offset, next.size });
+                                        }
+                                        end = next.offset + next.size;
+                                        used += next.reserved;
+                                        nbOps++;
+                                }
+                        }
+                        lock.unlock();
+
+                        bool ok = this->process(op, iov);
+
+                        lock.lock();
+                        if (op.type == OP_OPEN) {
+                                m_pendingOpens--;
+                        }
+                        if (!ok && (m_pendingOpens == 0)) {
+                                m_error = true;
+                        }
+                        m_opRead = (m_opRead + nbOps) % m_ops.size();
+                        m_opCount -= nbOps;
+                        m_readPos = end;
+                        m_used -= used;
+                }
+        }
+
+        bool process(const Operation & op, std::vector<struct iovec> & iov) {
+                bool ok = true;
+                switch (op.type) {
+                        case OP_OPEN: {
+                                this->closeFile();
+                                const char* name = (const char*)iov[0].iov_base;
+                                m_fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                                if (m_fd == -1) {
+                                        LOG(WARN) << "Cannot open file:" << name << " " << strerror(errno);
+                                        ok = false;
+                                } else if (op.arg > 0) {
+                                        if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, op.arg) == 0) {
+                                                m_reserved = op.arg;
+                                        } else {
+                                                LOG(INFO) << "fallocate " << name << " " << strerror(errno);
+                                        }
+                                }
+                                m_offset = 0;
+                                m_flushed = 0;
+                                break;
+                        }
+                        case OP_WRITE:
+                                ok = this->writeAll(iov);
+                                break;
+                        case OP_PWRITE:
+                                if ( (m_fd != -1) && (::pwrite(m_fd, iov[0].iov_base, iov[0].iov_len, op.arg) != (ssize_t)iov[0].iov_len) ) {
+                                        LOG(WARN) << "pwrite error " << strerror(errno);
+                                        ok = false;
+                                }
+                                break;
+                        case OP_CLOSE:
+                                this->closeFile();
+                                break;
+                }
+                return ok;
+        }
+
+        bool writeAll(std::vector<struct iovec> & iov) {
+                bool ok = true;
+                struct iovec* ptr = iov.data();
+                int iovcnt = iov.size();
+                while ( (m_fd != -1) && (iovcnt > 0) ) {
+                        ssize_t ret = ::writev(m_fd, ptr, iovcnt);
+                        if (ret < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                LOG(WARN) << "write error " << strerror(errno);
+                                ok = false;
+                                break;
+                        }
+                        m_offset += ret;
+                        while ( (iovcnt > 0) && ((size_t)ret >= ptr->iov_len) ) {
+                                ret -= ptr->iov_len;
+                                ptr++;
+                                iovcnt--;
+                        }
+                        if (iovcnt > 0) {
+                                ptr->iov_base = (char*)ptr->iov_base + ret;
+                                ptr->iov_len -= ret;
+                        }
+                }
+
+                // start writeback early instead of letting dirty pages accumulate until a large flush
+                if (m_offset - m_flushed >= FLUSH_SIZE) {
+                        sync_file_range(m_fd, m_flushed, m_offset - m_flushed, SYNC_FILE_RANGE_WRITE);
+                        if (m_flushed >= FLUSH_SIZE) {
+                                posix_fadvise(m_fd, 0, m_flushed - FLUSH_SIZE, POSIX_FADV_DONTNEED);
+                        }
+                        m_flushed = m_offset;
+                }
+                return ok;
+        }
+
+        // truncating to the written size releases the blocks reserved past the end of a segment cut short
+        void closeFile() {
+                if (m_fd != -1) {
+                        struct stat st;
+                        if ( (m_reserved > 0) && (fstat(m_fd, &st) == 0) && ((unsigned long long)st.st_size < m_reserved) ) {
+                                if (ftruncate(m_fd, st.st_size) != 0) {
+                                        LOG(INFO) << "ftruncate " << strerror(errno);
+                                }
+                        }
+                        m_reserved = 0;
+                        ::close(m_fd);
+                        m_fd = -1;
+                }
+        }
+
+    protected:
+        static const unsigned long long FLUSH_SIZE = 4*1024*1024;
+
+        std::vector<char>       m_buffer;
+        size_t                  m_readPos;
+        size_t                  m_writePos;
+        size_t                  m_used;
+        std::vector<Operation>  m_ops;
+        size_t                  m_opRead;
+        size_t                  m_opCount;
+        bool                    m_stop;
+        bool                    m_error;
+        unsigned int            m_pendingOpens;
+        std::mutex              m_mutex;
+        std::condition_variable m_cond;
+        std::thread             m_thread;
+
+        // accessed only by the writer thread
+        int                     m_fd;
+        unsigned long long      m_offset;
+        unsigned long long      m_flushed;
+        unsigned long long      m_reserved;
+};
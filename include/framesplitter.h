@@ -0,0 +1,173 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** framesplitter.h
+**
+** Split a recorded elementary stream in frames :
+**  - H264/HEVC : Annex-B access units
+**  - JPEG      : concatenated MJPEG images
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "nalscanner.h"
+
+class FrameSplitter {
+    public:
+        FrameSplitter(int format, const uint8_t* buffer, size_t size)
+            : m_format(format), m_buffer(buffer), m_size(size), m_pos(0), m_nals(buffer, size, format == V4L2_PIX_FMT_HEVC), m_pending(false) {}
+
+        // next frame, false at the end of the buffer
+        bool next(const uint8_t* & frame, size_t & size) {
+                size_t start = 0;
+                size_t end = 0;
+                if ( (m_format == V4L2_PIX_FMT_H264) || (m_format == V4L2_PIX_FMT_HEVC) ) {
+                        end = this->nextAccessUnit(start);
+                } else if ( (m_format == V4L2_PIX_FMT_JPEG) || (m_format == V4L2_PIX_FMT_MJPEG) ) {
+                        end = this->nextJpeg(start);
+                }
+                frame = m_buffer + start;
+                size = end - start;
+                return (end > start);
+        }
+
+    protected:
+        // an access unit ends before the first NAL that begins the next picture
+        size_t nextAccessUnit(size_t & start) {
+                start = m_size;
+                bool hasPicture = false;
+                NalUnit nal;
+                bool valid = m_pending;
+                if (m_pending) {
+                        nal = m_pendingNal;
+                        m_pending = false;
+                } else {
+                        valid = m_nals.next(nal);
+                }
+                while (valid) {
+                        size_t nalStart = this->startCodeOffset(nal);
+                        if (start == m_size) {
+                                start = nalStart;
+                        } else if (hasPicture && this->beginsPicture(nal)) {
+                                m_pending = true;
+                                m_pendingNal = nal;
+                                return nalStart;
+                        }
+                        hasPicture = hasPicture || this->isVcl(nal);
+                        valid = m_nals.next(nal);
+                }
+                return m_size;
+        }
+
+        size_t startCodeOffset(const NalUnit & nal) {
+                size_t offset = nal.offset - 3;
+                if ( (offset > 0) && (m_buffer[offset-1] == 0) ) {
+                        offset--;
+                }
+                return offset;
+        }
+
+        bool isVcl(const NalUnit & nal) {
+                if (m_format == V4L2_PIX_FMT_H264) {
+                        return (nal.type >= 1) && (nal.type <= 5);
+                } else {
+                        return (nal.type < 32);
+                }
+        }
+
+        bool beginsPicture(const NalUnit & nal) {
+                const uint8_t* data = m_buffer + nal.offset;
+                int type = nal.type;
+                if (m_format == V4L2_PIX_FMT_H264) {
+                        if ( (type >= 1) && (type <= 5) ) {
+                                // first_mb_in_slice == 0 is coded as a single 1 bit
+                                return (nal.size > 1) && (data[1] & 0x80);
+                        }
+                        // SEI, SPS, PPS, AUD and reserved types precede the first slice
+                        return ( (type >= 6) && (type <= 9) ) || ( (type >= 14) && (type <= 18) );
+                } else {
+                        if (type < 32) {
+                                // first_slice_segment_in_pic_flag
+                                return (nal.size > 2) && (data[2] & 0x80);
+                        }
+                        // VPS, SPS, PPS, AUD, prefix SEI and reserved types precede the first slice
+                        return ( (type >= 32) && (type <= 35) ) || (type == 39) || ( (type >= 41) && (type <= 44) ) || ( (type >= 48) && (type <= 55) );
+                }
+        }
+
+        // from SOI to EOI, skipping marker segments so that EXIF thumbnails do not end the image
+        size_t nextJpeg(size_t & start) {
+                const uint8_t* p = m_buffer + m_pos;
+                const uint8_t* last = m_buffer + m_size;
+                // look for SOI
+                while ( (last - p >= 2) && !( (p[0] == 0xff) && (p[1] == 0xd8) ) ) {
+                        p = (const uint8_t*)memchr(p+1, 0xff, last - p - 1);
+                        if (p == NULL) {
+                                p = last;
+                        }
+                }
+                if (last - p < 2) {
+                        start = m_pos = m_size;
+                        return m_size;
+                }
+                start = p - m_buffer;
+                p += 2;
+                while (last - p >= 2) {
+                        if (p[0] != 0xff) {
+                                p++;
+                                continue;
+                        }
+                        uint8_t marker = p[1];
+                        if ( (marker == 0xff) || (marker == 0x01) || ((marker >= 0xd0) && (marker <= 0xd7)) ) {
+                                // fill byte, TEM or RST have no length
+                                p += (marker == 0xff) ? 1 : 2;
+                                continue;
+                        }
+                        if (marker == 0xd9) {
+                                p += 2;
+                                break;
+                        }
+                        if (last - p < 4) {
+                                p = last;
+                                break;
+                        }
+                        p += 2 + ((p[2] << 8) | p[3]);
+                        if (marker == 0xda) {
+                                // entropy coded data ends at the first marker that is not a stuffed byte or a RST
+                                while (p < last) {
+                                        p = (const uint8_t*)memchr(p, 0xff, last - p);
+                                        if ( (p == NULL) || (last - p < 2) ) {
+                                                p = last;
+                                                break;
+                                        }
+                                        if ( (p[1] == 0) || ((p[1] >= 0xd0) && (p[1] <= 0xd7)) ) {
+                                                p += 2;
+                                        } else {
+                                                break;
+                                        }
+                                }
+                        }
+                }
+                if (p > last) {
+                        p = last;
+                }
+                m_pos = p - m_buffer;
+                return m_pos;
+        }
+
+    protected:
+        int            m_format;
+        const uint8_t* m_buffer;
+        size_t         m_size;
+        size_t         m_pos;
+        NalSplitter    m_nals;
+        bool           m_pending;
+        NalUnit        m_pendingNal;
+};
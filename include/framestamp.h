@@ -0,0 +1,236 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** framestamp.h
+**
+** Sequence number and monotonic timestamp carried with a frame :
+**  - raw frames : barcode of black and white blocks in the bottom left corner,
+**    16 bits sync, 32 bits sequence, 64 bits timestamp in microseconds
+**  - H264/HEVC  : user data unregistered SEI
+**  - JPEG       : COM marker
+** SEI and COM payload is a 16 bytes UUID, the sequence and the timestamp in big endian.
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "nalscanner.h"
+
+struct FrameStamp {
+        FrameStamp(uint32_t sequence = 0, uint64_t timestamp = 0) : sequence(sequence), timestamp(timestamp) {}
+
+        uint32_t sequence;
+        uint64_t timestamp;   // CLOCK_MONOTONIC in microseconds
+
+        static uint64_t now() {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+        }
+
+        static const int columns = 16;
+        static const int rows = 7;
+        static const uint16_t sync = 0xa5c3;
+
+        // size of a block, even to stay aligned on chroma, 0 when the barcode does not fit
+        static int blockSize(int width, int height) {
+                int block = std::max(8, (height/60) & ~1);
+                if ( (block*columns > width) || (block*rows > height) ) {
+                        block = 0;
+                }
+                return block;
+        }
+
+        // bit of the block at column, row
+        bool bit(int column, int row) const {
+                int index = row*columns + column;
+                if (index < 16) {
+                        return (sync >> (15 - index)) & 1;
+                } else if (index < 48) {
+                        return (sequence >> (47 - index)) & 1;
+                } else {
+                        return (timestamp >> (111 - index)) & 1;
+                }
+        }
+
+        static const size_t payloadSize = 28;
+
+        static const uint8_t* uuid() {
+                static const uint8_t id[16] = { 0x76, 0x34, 0x6c, 0x32, 0x74, 0x6f, 0x6f, 0x6c, 0x73, 0x2d, 0x73, 0x74, 0x61, 0x6d, 0x70, 0x01 };
+                return id;
+        }
+
+        // payloadSize bytes for SEI or COM
+        void serialize(uint8_t* out) const {
+                memcpy(out, uuid(), 16);
+                for (int i=0; i<4; ++i) {
+                        out[16+i] = (sequence >> (24 - 8*i)) & 0xff;
+                }
+                for (int i=0; i<8; ++i) {
+                        out[20+i] = (timestamp >> (56 - 8*i)) & 0xff;
+                }
+        }
+
+        bool parse(const uint8_t* data, size_t size) {
+                if ( (size < payloadSize) || (memcmp(data, uuid(), 16) != 0) ) {
+                        return false;
+                }
+                sequence = 0;
+                for (int i=0; i<4; ++i) {
+                        sequence = (sequence << 8) | data[16+i];
+                }
+                timestamp = 0;
+                for (int i=0; i<8; ++i) {
+                        timestamp = (timestamp << 8) | data[20+i];
+                }
+                return true;
+        }
+
+        // look for the stamp of a frame according to its format
+        bool extract(int format, const uint8_t* frame, size_t size, int width, int height) {
+                bool found = false;
+                switch (format) {
+                        case V4L2_PIX_FMT_H264:
+                        case V4L2_PIX_FMT_HEVC: {
+                                bool hevc = (format == V4L2_PIX_FMT_HEVC);
+                                NalSplitter splitter(frame, size, hevc);
+                                NalUnit nal;
+                                while (!found && splitter.next(nal)) {
+                                        if ( (nal.size > 2) && (hevc ? ((nal.type == 39) || (nal.type == 40)) : (nal.type == 6)) ) {
+                                                found = this->extractSei(splitter.data(nal) + (hevc ? 2 : 1), nal.size - (hevc ? 2 : 1));
+                                        } else if ( hevc ? (nal.type < 32) : ((nal.type >= 1) && (nal.type <= 5)) ) {
+                                                // SEI precede the slices
+                                                break;
+                                        }
+                                }
+                                break;
+                        }
+                        case V4L2_PIX_FMT_JPEG:
+                        case V4L2_PIX_FMT_MJPEG:
+                                found = this->extractJpeg(frame, size);
+                                break;
+                        case V4L2_PIX_FMT_YUYV:
+                                found = (size >= (size_t)width*height*2) && this->decode(frame, 2, width*2, width, height);
+                                break;
+                        case V4L2_PIX_FMT_UYVY:
+                                found = (size >= (size_t)width*height*2) && this->decode(frame + 1, 2, width*2, width, height);
+                                break;
+                        case V4L2_PIX_FMT_NV12:
+                        case V4L2_PIX_FMT_YUV420:
+                                found = (size >= (size_t)width*height) && this->decode(frame, 1, width, width, height);
+                                break;
+                        case V4L2_PIX_FMT_RGB24:
+                                // green is close enough to luma for black and white blocks
+                                found = (size >= (size_t)width*height*3) && this->decode(frame + 1, 3, width*3, width, height);
+                                break;
+                }
+                return found;
+        }
+
+        // sample the center of each block, luma of pixel x in row y is luma[y*stride + x*step]
+        bool decode(const uint8_t* luma, int step, int stride, int width, int height) {
+                int block = blockSize(width, height);
+                if (block == 0) {
+                        return false;
+                }
+                int top = height - rows*block;
+                uint16_t syncValue = 0;
+                uint32_t sequenceValue = 0;
+                uint64_t timestampValue = 0;
+                for (int index=0; index<rows*columns; ++index) {
+                        int x = (index % columns)*block + block/2;
+                        int y = top + (index / columns)*block + block/2;
+                        unsigned int value = (luma[y*stride + x*step] >= 128) ? 1 : 0;
+                        if (index < 16) {
+                                syncValue = (syncValue << 1) | value;
+                        } else if (index < 48) {
+                                sequenceValue = (sequenceValue << 1) | value;
+                        } else {
+                                timestampValue = (timestampValue << 1) | value;
+                        }
+                }
+                if (syncValue != sync) {
+                        return false;
+                }
+                sequence = sequenceValue;
+                timestamp = timestampValue;
+                return true;
+        }
+
+    protected:
+        // SEI messages of a NAL payload after its header
+        bool extractSei(const uint8_t* data, size_t size) {
+                // remove emulation prevention bytes
+                std::vector<uint8_t> rbsp;
+                rbsp.reserve(size);
+                int zeros = 0;
+                for (size_t i=0; i<size; ++i) {
+                        if ( (zeros >= 2) && (data[i] == 3) ) {
+                                zeros = 0;
+                                continue;
+                        }
+                        rbsp.push_back(data[i]);
+                        zeros = data[i] ? 0 : zeros+1;
+                }
+                size_t pos = 0;
+                while (pos + 2 <= rbsp.size()) {
+                        unsigned int type = 0;
+                        while ( (pos < rbsp.size()) && (rbsp[pos] == 0xff) ) {
+                                type += 255;
+                                pos++;
+                        }
+                        size_t payload = 0;
+                        if (pos < rbsp.size()) {
+                                type += rbsp[pos++];
+                        }
+                        while ( (pos < rbsp.size()) && (rbsp[pos] == 0xff) ) {
+                                payload += 255;
+                                pos++;
+                        }
+                        if (pos < rbsp.size()) {
+                                payload += rbsp[pos++];
+                        }
+                        if (pos + payload > rbsp.size()) {
+                                break;
+                        }
+                        if ( (type == 5) && this->parse(rbsp.data() + pos, payload) ) {
+                                return true;
+                        }
+                        pos += payload;
+                }
+                return false;
+        }
+
+        // COM markers before the scan
+        bool extractJpeg(const uint8_t* data, size_t size) {
+                size_t pos = 2;
+                if ( (size < 4) || (data[0] != 0xff) || (data[1] != 0xd8) ) {
+                        return false;
+                }
+                while (pos + 4 <= size) {
+                        if (data[pos] != 0xff) {
+                                break;
+                        }
+                        uint8_t marker = data[pos+1];
+                        size_t length = (data[pos+2] << 8) | data[pos+3];
+                        if ( (marker == 0xda) || (length < 2) || (pos + 2 + length > size) ) {
+                                break;
+                        }
+                        if ( (marker == 0xfe) && this->parse(data + pos + 4, length - 2) ) {
+                                return true;
+                        }
+                        pos += 2 + length;
+                }
+                return false;
+        }
+};
@@ -4,83 +4,116 @@
 ** any purpose.
 **
 ** jpegdecoder.h
-** 
+**
 ** -------------------------------------------------------------------------*/
 
 #pragma once
 
+#include <vector>
+
 #include "libyuv.h"
 #include "logger.h"
 #include "codecfactory.h"
 
 #include <jpeglib.h>
 
-class V4l2Output;
-
 class JpegDecoder : public Codec {
 	public:
-		JpegDecoder(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
-			: Codec(informat, width, height), m_outformat(outformat) {	
+		JpegDecoder(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose)
+			: Codec(informat, width, height), m_outformat(outformat) {
 
-			jpeg_create_decompress(&m_cinfo);
 			m_cinfo.err = jpeg_std_error(&m_jerr);
-
-			m_i420buffer = new unsigned char [width*height*3/2];
+			jpeg_create_decompress(&m_cinfo);
 		}
 
-		void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) {
-                uint8_t *i420_p0 = m_i420buffer;
-                uint8_t *i420_p1 = i420_p0 + m_width * m_height;
-                uint8_t *i420_p2 = i420_p1 + m_width * m_height / 2;
+		void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
+				m_i420buffer.resize(m_width*m_height + 2*((m_width+1)/2)*((m_height+1)/2));
+				I420Frame frame(m_i420buffer.data(), m_i420buffer.data() + m_width*m_height, m_i420buffer.data() + m_width*m_height + ((m_width+1)/2)*((m_height+1)/2), m_width, m_height);
+				if (!this->decode(buffer, rsize, frame)) {
+					return;
+				}
+
+                char outBuffer[sink->getBufferSize()];
+                libyuv::ConvertFromI420(frame.y, frame.strideY,
+                                        frame.u, frame.strideUV,
+                                        frame.v, frame.strideUV,
+                                        (uint8_t *)outBuffer, 0,
+                                        m_width, m_height,
+                                        m_outformat);
+
+                int wsize = sink->write((char *)outBuffer, sizeof(outBuffer), FrameInfo(true));
+                LOG(DEBUG) << "Copied size:" << wsize;
+
+		}
 
-				jpeg_mem_src(&m_cinfo, (unsigned char*)buffer, rsize);	
-				jpeg_read_header(&m_cinfo, TRUE);
-				LOG(INFO) << "width:" << m_cinfo.image_width << " height:" << m_cinfo.image_height << " num_components:" << m_cinfo.num_components; 
+		// decode in place when the picture has the size of the frame, otherwise decode aside and scale
+		bool decode(const char* buffer, unsigned int rsize, const I420Frame & frame) {
+				jpeg_mem_src(&m_cinfo, (unsigned char*)buffer, rsize);
+				if (jpeg_read_header(&m_cinfo, TRUE) != JPEG_HEADER_OK) {
+					LOG(WARN) << "Cannot read JPEG header size:" << rsize;
+					return false;
+				}
+				LOG(DEBUG) << "width:" << m_cinfo.image_width << " height:" << m_cinfo.image_height << " num_components:" << m_cinfo.num_components;
 				m_cinfo.out_color_space = JCS_YCbCr;
 
+				int width = m_cinfo.image_width;
+				int height = m_cinfo.image_height;
+				bool scale = (width != frame.width) || (height != frame.height);
+				I420Frame picture = frame;
+				if (scale) {
+					m_scaleBuffer.resize(width*height + 2*((width+1)/2)*((height+1)/2));
+					picture = I420Frame(m_scaleBuffer.data(), m_scaleBuffer.data() + width*height, m_scaleBuffer.data() + width*height + ((width+1)/2)*((height+1)/2), width, height);
+				}
+
 				jpeg_start_decompress(&m_cinfo);
 
-				unsigned char bufline[m_cinfo.image_width *  m_cinfo.num_components]; 
-				while (m_cinfo.output_scanline < m_cinfo.output_height) 
-				{ 
-					JSAMPROW row = bufline; 
+				// chroma is taken from the even rows and columns
+				unsigned char bufline[m_cinfo.output_width * m_cinfo.output_components];
+				while (m_cinfo.output_scanline < m_cinfo.output_height)
+				{
+					unsigned int line = m_cinfo.output_scanline;
+					JSAMPROW row = bufline;
 					jpeg_read_scanlines(&m_cinfo, &row, 1);
-					for (unsigned int i = 0; i < m_cinfo.image_width; ++i) 
-					{ 
-						i420_p0[m_cinfo.output_scanline*m_cinfo.image_width + i]       = bufline[i*3  ]; 
-						i420_p1[(m_cinfo.output_scanline*m_cinfo.image_width/2 + i)/2] = bufline[i*3+1]; 
-						i420_p2[(m_cinfo.output_scanline*m_cinfo.image_width/2 + i)/2] = bufline[i*3+2];  
-					} 
+					uint8_t* y = picture.y + line*picture.strideY;
+					for (unsigned int i = 0; i < m_cinfo.output_width; ++i)
+					{
+						y[i] = bufline[i*3];
+					}
+					if ((line & 1) == 0)
+					{
+						uint8_t* u = picture.u + (line/2)*picture.strideUV;
+						uint8_t* v = picture.v + (line/2)*picture.strideUV;
+						for (unsigned int i = 0; i < m_cinfo.output_width; i += 2)
+						{
+							u[i/2] = bufline[i*3+1];
+							v[i/2] = bufline[i*3+2];
+						}
+					}
 				}
 				jpeg_finish_decompress(&m_cinfo);
 
-                char outBuffer[videoOutput->getBufferSize()];
-                libyuv::ConvertFromI420(i420_p0, m_width,
-                                        i420_p1, (m_width + 1) / 2,
-                                        i420_p2, (m_width + 1) / 2,
-                                        (uint8_t *)outBuffer, 0,
-                                        m_width, m_height,
-                                        m_outformat);
-
-                int wsize = videoOutput->write((char *)outBuffer,videoOutput->getBufferSize());
-                LOG(DEBUG) << "Copied size:" << wsize;
+				if (scale) {
+					libyuv::I420Scale(picture.y, picture.strideY, picture.u, picture.strideUV, picture.v, picture.strideUV, width, height,
+							frame.y, frame.strideY, frame.u, frame.strideUV, frame.v, frame.strideUV, frame.width, frame.height,
+							libyuv::kFilterBilinear);
+				}
+				return true;
+		}
 
-		}			
-						
 		~JpegDecoder() {
 				jpeg_destroy_decompress(&m_cinfo);
-				delete [] m_i420buffer;
-		}				
+		}
 
 	private:
 		struct jpeg_error_mgr 			m_jerr;
-		struct jpeg_decompress_struct 	m_cinfo;	
-		unsigned char * 				m_i420buffer;
+		struct jpeg_decompress_struct 	m_cinfo;
+		std::vector<uint8_t> 			m_i420buffer;
+		std::vector<uint8_t> 			m_scaleBuffer;
 		int 							m_outformat;
 
 	public:
-		static const bool 				registration;		
+		static const bool 				registration;
 };
 
-const bool JpegDecoder::registration = CodecFactory::get().registerDecoder(V4L2_PIX_FMT_JPEG, CodecCreator<JpegDecoder>::Create);
+const bool JpegDecoder::registration = CodecFactory::get().registerDecoder(V4L2_PIX_FMT_JPEG, CodecCreator<JpegDecoder>::Create, CodecCreator<JpegDecoder>::Options, "libjpeg", 50) && CodecFactory::get().registerDecoder(V4L2_PIX_FMT_MJPEG, CodecCreator<JpegDecoder>::Create, CodecCreator<JpegDecoder>::Options, "libjpeg", 50);
 
@@ -15,11 +15,17 @@
 
 #include <jpeglib.h>
 
-class V4l2Output;
-
 class JpegEncoder : public Codec {
 	public:
-		JpegEncoder(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
+		static const std::vector<CodecOption> & Options() {
+			static const std::vector<CodecOption> options = {
+				CodecOption::Integer("QUALITY", &CodecConfig::quality, 1, 100,   -1, false, "JPEG quality"),
+				CodecOption::Integer("DRI",     &CodecConfig::dri,     0, 65535, -1, false, "restart interval in MCU"),
+			};
+			return options;
+		}
+
+		JpegEncoder(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose) 
 			: Codec(informat, width, height) {	
 
 			jpeg_create_compress(&m_cinfo);
@@ -30,55 +36,68 @@ class JpegEncoder : public Codec {
 			m_cinfo.err = jpeg_std_error(&m_jerr);
 
 			jpeg_set_defaults(&m_cinfo);
-			std::map<std::string,std::string>::const_iterator quality = opt.find("QUALITY");
-			if (quality != opt.end()) {
-				int value = std::stoi(quality->second);
-				jpeg_set_quality(&m_cinfo, value, TRUE);
+			if (config.quality > 0) {
+				jpeg_set_quality(&m_cinfo, config.quality, TRUE);
 			}
-			std::map<std::string,std::string>::const_iterator dri = opt.find("DRI");
-			if (dri != opt.end()) {
-				int value = std::stoi(dri->second);
-				m_cinfo.restart_interval = value;
+			if (config.dri >= 0) {
+				m_cinfo.restart_interval = config.dri;
 			}						
 
-			m_i420buffer = new unsigned char [width*height*3/2];
+			m_i420buffer = new unsigned char [width*height + 2*((width+1)/2)*((height+1)/2)];
 		}
 
-		void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) {
-				unsigned char * buffer_y = m_i420buffer;
-				unsigned char * buffer_u = buffer_y + m_width*m_height;
-				unsigned char * buffer_v = buffer_u + m_width*m_height/4;
-
+		void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
+				I420Frame frame;
+				this->getInputFrame(frame);
 				libyuv::ConvertToI420((const uint8_t*)buffer, rsize,
-						buffer_y, m_width,
-						buffer_u, (m_width+1)/2,
-						buffer_v, (m_width+1)/2,
+						frame.y, frame.strideY,
+						frame.u, frame.strideUV,
+						frame.v, frame.strideUV,
 						0, 0,
 						m_width, m_height,
 						m_width, m_height,
 						libyuv::kRotate0, m_informat);
 
+				this->encode(sink);
+		}
+
+		bool getInputFrame(I420Frame & frame) {
+				frame = I420Frame(m_i420buffer, m_i420buffer + m_width*m_height, m_i420buffer + m_width*m_height + ((m_width+1)/2)*((m_height+1)/2), m_width, m_height);
+				return true;
+		}
+
+		void encode(Sink* sink) {
+				I420Frame frame;
+				this->getInputFrame(frame);
+
 				unsigned char* dest = NULL;
 				unsigned long  destsize = 0;
 				jpeg_mem_dest(&m_cinfo, &dest, &destsize);	
 
 				jpeg_start_compress(&m_cinfo, TRUE);
+				if (m_hasStamp) {
+					unsigned char stamp[FrameStamp::payloadSize];
+					m_stamp.serialize(stamp);
+					jpeg_write_marker(&m_cinfo, JPEG_COM, stamp, sizeof(stamp));
+					m_hasStamp = false;
+				}
 
 				unsigned char bufline[m_cinfo.image_width *  m_cinfo.num_components]; 
 				while (m_cinfo.next_scanline < m_cinfo.image_height) 
 				{ 
+					unsigned int chroma = (m_cinfo.next_scanline/2)*((m_cinfo.image_width+1)/2);
 					for (unsigned int i = 0; i < m_cinfo.image_width; ++i) 
 					{ 
-						bufline[i*3  ] = buffer_y[m_cinfo.next_scanline*m_cinfo.image_width + i]; 
-						bufline[i*3+1] = buffer_u[(m_cinfo.next_scanline*m_cinfo.image_width/2 + i)/2]; 
-						bufline[i*3+2] = buffer_v[(m_cinfo.next_scanline*m_cinfo.image_width/2 + i)/2];  
+						bufline[i*3  ] = frame.y[m_cinfo.next_scanline*m_cinfo.image_width + i]; 
+						bufline[i*3+1] = frame.u[chroma + i/2]; 
+						bufline[i*3+2] = frame.v[chroma + i/2];  
 					} 
 					JSAMPROW row = bufline; 
 					jpeg_write_scanlines(&m_cinfo, &row, 1); 
 				}
 				jpeg_finish_compress(&m_cinfo);
 						
-                int wsize = videoOutput->write((char *)dest,destsize);
+                int wsize = sink->write((char *)dest, destsize, FrameInfo(true));
                 LOG(DEBUG) << "Copied size:" << wsize;
 
 				free(dest);										
@@ -98,5 +117,5 @@ class JpegEncoder : public Codec {
 		static const bool registration;		
 };
 
-const bool JpegEncoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_JPEG, CodecCreator<JpegEncoder>::Create);
+const bool JpegEncoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_JPEG, CodecCreator<JpegEncoder>::Create, CodecCreator<JpegEncoder>::Options, "libjpeg", 50);
 
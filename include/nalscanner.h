@@ -0,0 +1,165 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** nalscanner.h
+**
+** Split H264/HEVC Annex-B streams in NAL units
+** Start codes are searched with SSE2/AVX2/NEON when available
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NALSCANNER_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NALSCANNER_NEON
+#endif
+
+// first 00 00 01 in [p, end), end when not found
+inline const uint8_t* findStartCodeScalar(const uint8_t* p, const uint8_t* end) {
+        while (end - p >= 3) {
+                if (p[2] > 1) {
+                        p += 3;
+                } else if ( (p[0] == 0) && (p[1] == 0) && (p[2] == 1) ) {
+                        return p;
+                } else {
+                        p++;
+                }
+        }
+        return end;
+}
+
+#ifdef NALSCANNER_X86
+#if defined(__SSE2__)
+inline const uint8_t* findStartCodeSSE2(const uint8_t* p, const uint8_t* end) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi8(1);
+        // 16 candidate positions need 18 readable bytes
+        while (end - p >= 18) {
+                __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+                __m128i b1 = _mm_loadu_si128((const __m128i*)(p+1));
+                __m128i b2 = _mm_loadu_si128((const __m128i*)(p+2));
+                __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+                int mask = _mm_movemask_epi8(m);
+                if (mask) {
+                        return p + __builtin_ctz(mask);
+                }
+                p += 16;
+        }
+        return findStartCodeScalar(p, end);
+}
+#endif
+
+__attribute__((target("avx2")))
+inline const uint8_t* findStartCodeAVX2(const uint8_t* p, const uint8_t* end) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi8(1);
+        while (end - p >= 34) {
+                __m256i b0 = _mm256_loadu_si256((const __m256i*)p);
+                __m256i b1 = _mm256_loadu_si256((const __m256i*)(p+1));
+                __m256i b2 = _mm256_loadu_si256((const __m256i*)(p+2));
+                __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+                unsigned int mask = _mm256_movemask_epi8(m);
+                if (mask) {
+                        return p + __builtin_ctz(mask);
+                }
+                p += 32;
+        }
+        return findStartCodeScalar(p, end);
+}
+#endif
+
+#ifdef NALSCANNER_NEON
+inline const uint8_t* findStartCodeNEON(const uint8_t* p, const uint8_t* end) {
+        const uint8x16_t zero = vdupq_n_u8(0);
+        const uint8x16_t one = vdupq_n_u8(1);
+        while (end - p >= 18) {
+                uint8x16_t m = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero), vceqq_u8(vld1q_u8(p+1), zero)), vceqq_u8(vld1q_u8(p+2), one));
+                uint64x2_t m64 = vreinterpretq_u64_u8(m);
+                uint64_t lo = vgetq_lane_u64(m64, 0);
+                uint64_t hi = vgetq_lane_u64(m64, 1);
+                if (lo) {
+                        return p + __builtin_ctzll(lo) / 8;
+                }
+                if (hi) {
+                        return p + 8 + __builtin_ctzll(hi) / 8;
+                }
+                p += 16;
+        }
+        return findStartCodeScalar(p, end);
+}
+#endif
+
+typedef const uint8_t* (*findStartCodeFunc)(const uint8_t* p, const uint8_t* end);
+
+// best implementation for the running CPU
+inline findStartCodeFunc getFindStartCode() {
+        findStartCodeFunc func = findStartCodeScalar;
+#ifdef NALSCANNER_X86
+#if defined(__SSE2__)
+        func = findStartCodeSSE2;
+#endif
+        if (__builtin_cpu_supports("avx2")) {
+                func = findStartCodeAVX2;
+        }
+#elif defined(NALSCANNER_NEON)
+        func = findStartCodeNEON;
+#endif
+        return func;
+}
+
+inline const uint8_t* findStartCode(const uint8_t* p, const uint8_t* end) {
+        static const findStartCodeFunc func = getFindStartCode();
+        return func(p, end);
+}
+
+struct NalUnit {
+        size_t offset;   // offset of the NAL header in the buffer
+        size_t size;     // size without start code and trailing zeros
+        int    type;     // nal_unit_type of H264 or HEVC header
+};
+
+// iterate over the NAL units of an Annex-B buffer in a single pass
+class NalSplitter {
+    public:
+        NalSplitter(const uint8_t* buffer, size_t size, bool hevc = false)
+            : m_buffer(buffer), m_end(buffer + size), m_next(findStartCode(buffer, buffer + size)), m_hevc(hevc) {}
+
+        bool next(NalUnit & nal) {
+                while (m_next < m_end) {
+                        const uint8_t* start = m_next + 3;
+                        m_next = findStartCode(start, m_end);
+                        // trailing zeros belong to the next 4 bytes start code or are padding
+                        const uint8_t* stop = m_next;
+                        while ( (stop > start) && (stop[-1] == 0) ) {
+                                stop--;
+                        }
+                        if (stop > start) {
+                                nal.offset = start - m_buffer;
+                                nal.size = stop - start;
+                                nal.type = m_hevc ? ((start[0] >> 1) & 0x3f) : (start[0] & 0x1f);
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        const uint8_t* data(const NalUnit & nal) {
+                return m_buffer + nal.offset;
+        }
+
+    private:
+        const uint8_t* m_buffer;
+        const uint8_t* m_end;
+        const uint8_t* m_next;
+        bool           m_hevc;
+};
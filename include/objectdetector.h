@@ -0,0 +1,158 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** objectdetector.h
+**
+** Run a cascade classifier from a dedicated thread on a downscaled luma plane,
+** one frame every interval is submitted when the thread is idle, the caller
+** never waits for the detection and gets the latest result
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <opencv2/objdetect.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "libyuv.h"
+
+#include "logger.h"
+
+class ObjectDetector {
+    public:
+        ObjectDetector(const std::string & cascade, int width, int height, int detectWidth = 320, unsigned int interval = 5)
+            : m_width(width), m_height(height), m_interval(interval ? interval : 1)
+            , m_busy(false), m_stop(false), m_submitted(0), m_detected(0), m_updated(false) {
+                // keep the aspect ratio, never upscale
+                m_detectWidth = std::min(std::max(detectWidth, 32), width) & ~1;
+                m_detectHeight = (int)((long long)height * m_detectWidth / width) & ~1;
+                m_plane.resize(m_detectWidth * m_detectHeight);
+                if (!m_cascade.load(cascade)) {
+                        LOG(WARN) << "Cannot load cascade:" << cascade;
+                } else {
+                        LOG(NOTICE) << "Detection on " << m_detectWidth << "x" << m_detectHeight << " every " << m_interval << " frames";
+                        m_thread = std::thread(&ObjectDetector::run, this);
+                }
+        }
+
+        virtual ~ObjectDetector() {
+                {
+                        std::unique_lock<std::mutex> lock(m_mutex);
+                        m_stop = true;
+                }
+                m_cond.notify_all();
+                if (m_thread.joinable()) {
+                        m_thread.join();
+                }
+        }
+
+        bool isValid() {
+                return !m_cascade.empty();
+        }
+
+        // downscale the luma plane of a frame for the detection thread, skipped while it is busy
+        bool process(const uint8_t* luma, int stride, unsigned int frameIndex) {
+                if ( !this->isValid() || (frameIndex % m_interval != 0) ) {
+                        return false;
+                }
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_busy) {
+                        return false;
+                }
+                libyuv::ScalePlane(luma, stride, m_width, m_height,
+                                   m_plane.data(), m_detectWidth, m_detectWidth, m_detectHeight,
+                                   libyuv::kFilterBox);
+                m_busy = true;
+                m_submitted = frameIndex;
+                m_cond.notify_all();
+                return true;
+        }
+
+        // latest detection in frame coordinates and the index of the frame it was run on
+        std::vector<cv::Rect> getObjects(unsigned int* frameIndex = NULL) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (frameIndex) {
+                        *frameIndex = m_detected;
+                }
+                return m_objects;
+        }
+
+        // new detection since the last call, with the plane it ran on for the tracking
+        bool getResult(std::vector<cv::Rect> & objects, std::vector<uint8_t> & plane, unsigned int & frameIndex) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (!m_updated) {
+                        return false;
+                }
+                m_updated = false;
+                objects = m_objects;
+                plane = m_resultPlane;
+                frameIndex = m_detected;
+                return true;
+        }
+
+        int getWidth()        { return m_width;        }
+        int getHeight()       { return m_height;       }
+        int getDetectWidth()  { return m_detectWidth;  }
+        int getDetectHeight() { return m_detectHeight; }
+
+    protected:
+        void run() {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_stop) {
+                        if (!m_busy) {
+                                m_cond.wait(lock);
+                                continue;
+                        }
+                        // the plane is not touched by process while busy
+                        unsigned int frameIndex = m_submitted;
+                        lock.unlock();
+
+                        cv::Mat gray(m_detectHeight, m_detectWidth, CV_8UC1, m_plane.data());
+                        std::vector<cv::Rect> objects;
+                        m_cascade.detectMultiScale(gray, objects, 1.1, 3, 0, cv::Size(24, 24));
+                        for (cv::Rect & r : objects) {
+                                r.x = r.x * m_width / m_detectWidth;
+                                r.y = r.y * m_height / m_detectHeight;
+                                r.width = r.width * m_width / m_detectWidth;
+                                r.height = r.height * m_height / m_detectHeight;
+                        }
+
+                        lock.lock();
+                        m_objects.swap(objects);
+                        m_resultPlane = m_plane;
+                        m_detected = frameIndex;
+                        m_updated = true;
+                        m_busy = false;
+                }
+        }
+
+    protected:
+        int                     m_width;
+        int                     m_height;
+        int                     m_detectWidth;
+        int                     m_detectHeight;
+        unsigned int            m_interval;
+        cv::CascadeClassifier   m_cascade;
+        std::vector<uint8_t>    m_plane;
+        std::vector<cv::Rect>   m_objects;
+        std::vector<uint8_t>    m_resultPlane;
+        bool                    m_busy;
+        bool                    m_stop;
+        unsigned int            m_submitted;
+        unsigned int            m_detected;
+        bool                    m_updated;
+        std::mutex              m_mutex;
+        std::condition_variable m_cond;
+        std::thread             m_thread;
+};
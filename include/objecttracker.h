@@ -0,0 +1,187 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** objecttracker.h
+**
+** Carry detected objects between detections by template matching on a
+** downscaled luma plane :
+**  - templates are cut from the plane the detection ran on
+**  - each frame they are searched in a window around their last position
+**  - objects keep their id across detections when they overlap
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+#include <ostream>
+#include <algorithm>
+
+#include <opencv2/imgproc.hpp>
+
+#include "libyuv.h"
+
+struct TrackedObject {
+        int      id;
+        cv::Rect rect;        // in frame coordinates
+        float    score;       // correlation of the last match, 1 when detected
+        bool     detected;    // found by the detector in this frame
+        int      lost;        // frames without a good match
+
+        // position on the tracking plane and template of the same size
+        cv::Rect             area;
+        std::vector<uint8_t> model;
+};
+
+class ObjectTracker {
+    public:
+        ObjectTracker(int width, int height, int trackWidth, int trackHeight, float threshold = 0.5, int maxLost = 10)
+            : m_width(width), m_height(height), m_trackWidth(trackWidth), m_trackHeight(trackHeight)
+            , m_threshold(threshold), m_maxLost(maxLost), m_nextId(1), m_fresh(false), m_plane(trackWidth * trackHeight) {}
+
+        // objects detected on a plane of trackWidth x trackHeight, possibly of an older frame
+        void reset(const std::vector<cv::Rect> & objects, const uint8_t* plane) {
+                std::vector<TrackedObject> tracks;
+                for (const cv::Rect & r : objects) {
+                        TrackedObject obj;
+                        obj.id = 0;
+                        obj.rect = r;
+                        obj.score = 1;
+                        obj.detected = true;
+                        obj.lost = 0;
+                        obj.area = this->toPlane(r);
+                        if (obj.area.empty()) {
+                                continue;
+                        }
+                        // keep the id of the best overlapping track
+                        double best = 0.3;
+                        for (const TrackedObject & prev : m_objects) {
+                                double iou = this->overlap(prev.rect, r);
+                                if ( (iou > best) && !this->used(tracks, prev.id) ) {
+                                        best = iou;
+                                        obj.id = prev.id;
+                                }
+                        }
+                        if (obj.id == 0) {
+                                obj.id = m_nextId++;
+                        }
+                        this->setModel(obj, plane);
+                        tracks.push_back(obj);
+                }
+                m_objects.swap(tracks);
+                m_fresh = true;
+        }
+
+        // follow the objects in a new frame
+        const std::vector<TrackedObject> & track(const uint8_t* luma, int stride) {
+                // objects stay flagged as detected in the frame following the reset
+                bool fresh = m_fresh;
+                m_fresh = false;
+                libyuv::ScalePlane(luma, stride, m_width, m_height,
+                                   m_plane.data(), m_trackWidth, m_trackWidth, m_trackHeight,
+                                   libyuv::kFilterBox);
+                cv::Mat frame(m_trackHeight, m_trackWidth, CV_8UC1, m_plane.data());
+                for (TrackedObject & obj : m_objects) {
+                        obj.detected = obj.detected && fresh;
+                        // search window around the last position
+                        int margin = std::max(4, std::max(obj.area.width, obj.area.height) / 2);
+                        cv::Rect window(obj.area.x - margin, obj.area.y - margin, obj.area.width + 2*margin, obj.area.height + 2*margin);
+                        window = window & cv::Rect(0, 0, m_trackWidth, m_trackHeight);
+                        if ( (window.width < obj.area.width) || (window.height < obj.area.height) ) {
+                                obj.lost++;
+                                continue;
+                        }
+                        cv::Mat result;
+                        cv::Mat model(obj.area.height, obj.area.width, CV_8UC1, obj.model.data());
+                        cv::matchTemplate(frame(window), model, result, cv::TM_CCOEFF_NORMED);
+                        double maxScore = 0;
+                        cv::Point maxLoc;
+                        cv::minMaxLoc(result, NULL, &maxScore, NULL, &maxLoc);
+                        obj.score = maxScore;
+                        if (maxScore >= m_threshold) {
+                                obj.lost = 0;
+                                obj.area.x = window.x + maxLoc.x;
+                                obj.area.y = window.y + maxLoc.y;
+                                obj.rect.x = obj.area.x * m_width / m_trackWidth;
+                                obj.rect.y = obj.area.y * m_height / m_trackHeight;
+                        } else {
+                                obj.lost++;
+                        }
+                }
+                m_objects.erase(std::remove_if(m_objects.begin(), m_objects.end(),
+                                               [this](const TrackedObject & obj) { return obj.lost > m_maxLost; }),
+                                m_objects.end());
+                return m_objects;
+        }
+
+        const std::vector<TrackedObject> & getObjects() { return m_objects; }
+
+        // one JSON line per frame, sequence is the FrameStamp of the frame when it has one
+        void writeJson(std::ostream & os, unsigned int frameIndex, unsigned long long timestamp, long long sequence = -1) {
+                os << "{\"frame\":" << frameIndex << ",\"timestamp\":" << timestamp;
+                if (sequence >= 0) {
+                        os << ",\"sequence\":" << sequence;
+                }
+                os << ",\"width\":" << m_width << ",\"height\":" << m_height << ",\"objects\":[";
+                const char* sep = "";
+                for (const TrackedObject & obj : m_objects) {
+                        if (obj.lost) {
+                                continue;
+                        }
+                        os << sep << "{\"id\":" << obj.id
+                           << ",\"x\":" << obj.rect.x << ",\"y\":" << obj.rect.y
+                           << ",\"w\":" << obj.rect.width << ",\"h\":" << obj.rect.height
+                           << ",\"score\":" << (int)(obj.score*100)/100.0
+                           << ",\"detected\":" << (obj.detected ? "true" : "false") << "}";
+                        sep = ",";
+                }
+                os << "]}" << std::endl;
+        }
+
+    protected:
+        cv::Rect toPlane(const cv::Rect & r) {
+                cv::Rect area(r.x * m_trackWidth / m_width, r.y * m_trackHeight / m_height,
+                              r.width * m_trackWidth / m_width, r.height * m_trackHeight / m_height);
+                return area & cv::Rect(0, 0, m_trackWidth, m_trackHeight);
+        }
+
+        double overlap(const cv::Rect & a, const cv::Rect & b) {
+                int inter = (a & b).area();
+                int total = a.area() + b.area() - inter;
+                return total ? (double)inter / total : 0;
+        }
+
+        bool used(const std::vector<TrackedObject> & tracks, int id) {
+                for (const TrackedObject & obj : tracks) {
+                        if (obj.id == id) {
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        // copy the template so that it survives the plane
+        void setModel(TrackedObject & obj, const uint8_t* plane) {
+                obj.model.resize(obj.area.width * obj.area.height);
+                for (int y = 0; y < obj.area.height; ++y) {
+                        memcpy(obj.model.data() + y*obj.area.width, plane + (obj.area.y + y)*m_trackWidth + obj.area.x, obj.area.width);
+                }
+        }
+
+    protected:
+        int                        m_width;
+        int                        m_height;
+        int                        m_trackWidth;
+        int                        m_trackHeight;
+        float                      m_threshold;
+        int                        m_maxLost;
+        int                        m_nextId;
+        bool                       m_fresh;
+        std::vector<uint8_t>       m_plane;
+        std::vector<TrackedObject> m_objects;
+};
@@ -0,0 +1,379 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** patterngenerator.h
+**
+** Generate test patterns in YUYV, UYVY, NV12, I420 or RGB24
+**  background : gradient, bars (SMPTE), noise, black
+**  overlays   : box (moving), counter (frame index burn-in), stamp (FrameStamp barcode)
+**
+** The background is rendered once, each frame only restores and redraws the
+** overlays of the previous frame. Rows are filled once and copied.
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include <string>
+#include <vector>
+#include <random>
+#include <sstream>
+#include <algorithm>
+
+#include "framestamp.h"
+
+struct YuvColor {
+        uint8_t y;
+        uint8_t u;
+        uint8_t v;
+};
+
+class PatternGenerator {
+    public:
+        // patterns is a comma separated list like "bars,box,counter"
+        PatternGenerator(int format, int width, int height, const std::string & patterns)
+            : m_format(format), m_width(width & ~1), m_height(height & ~1), m_noise(false), m_box(false), m_counter(false), m_stamp(false), m_valid(isSupported(format)) {
+                std::string background = "black";
+                std::istringstream is(patterns);
+                std::string pattern;
+                while (std::getline(is, pattern, ',')) {
+                        if ( (pattern == "gradient") || (pattern == "bars") || (pattern == "noise") || (pattern == "black") ) {
+                                background = pattern;
+                        } else if (pattern == "box") {
+                                m_box = true;
+                        } else if (pattern == "counter") {
+                                m_counter = true;
+                        } else if (pattern == "stamp") {
+                                m_stamp = true;
+                        } else {
+                                m_valid = false;
+                        }
+                }
+                if (!this->isValid()) {
+                        return;
+                }
+
+                this->initPlanes();
+                m_background.resize(m_size);
+                if (background == "gradient") {
+                        this->renderGradient();
+                } else if (background == "bars") {
+                        this->renderBars();
+                } else if (background == "noise") {
+                        this->renderNoise();
+                } else {
+                        this->fillRect(m_background.data(), 0, 0, m_width, m_height, black());
+                }
+                m_frame.assign(m_background.begin(), m_background.begin() + m_size);
+        }
+
+        static bool isSupported(int format) {
+                return (format == V4L2_PIX_FMT_YUYV) || (format == V4L2_PIX_FMT_UYVY) || (format == V4L2_PIX_FMT_NV12)
+                    || (format == V4L2_PIX_FMT_YUV420) || (format == V4L2_PIX_FMT_RGB24);
+        }
+
+        bool isValid() { return m_valid && (m_width > 0) && (m_height > 0); }
+
+        static const char* getPatterns() { return "gradient, bars, noise, black, box, counter, stamp"; }
+
+        unsigned int getSize() { return m_size; }
+        int getWidth() { return m_width; }
+        int getHeight() { return m_height; }
+
+        // render frame index with its stamp and return the buffer of getSize() bytes
+        const char* getFrame(unsigned int index, const FrameStamp & stamp = FrameStamp()) {
+                if (m_noise) {
+                        // pick another window of the precomputed noise for each plane
+                        size_t rows = (m_background.size() - m_size) / m_planes[0].stride;
+                        size_t shift = m_rng() % (rows + 1);
+                        for (const Plane & plane : m_planes) {
+                                memcpy(m_frame.data() + plane.offset, m_background.data() + plane.offset + shift*plane.stride, plane.stride*(m_height/plane.vs));
+                        }
+                } else {
+                        for (const Rect & rect : m_dirty) {
+                                this->restoreRect(rect);
+                        }
+                }
+                m_dirty.clear();
+
+                if (m_box) {
+                        this->drawBox(index);
+                }
+                if (m_counter) {
+                        this->drawCounter(index);
+                }
+                if (m_stamp) {
+                        this->drawStamp(stamp);
+                }
+                return (const char*)m_frame.data();
+        }
+
+    protected:
+        struct Rect {
+                int x;
+                int y;
+                int w;
+                int h;
+        };
+
+        // a plane is made of units covering hs pixels horizontally and vs rows vertically
+        struct Plane {
+                size_t offset;
+                int    stride;
+                int    hs;
+                int    vs;
+                int    unitSize;
+        };
+
+        void initPlanes() {
+                size_t lumaSize = m_width*m_height;
+                switch (m_format) {
+                        case V4L2_PIX_FMT_YUYV:
+                        case V4L2_PIX_FMT_UYVY:
+                                m_planes.push_back({ 0, m_width*2, 2, 1, 4 });
+                                break;
+                        case V4L2_PIX_FMT_RGB24:
+                                m_planes.push_back({ 0, m_width*3, 1, 1, 3 });
+                                break;
+                        case V4L2_PIX_FMT_NV12:
+                                m_planes.push_back({ 0, m_width, 1, 1, 1 });
+                                m_planes.push_back({ lumaSize, m_width, 2, 2, 2 });
+                                break;
+                        case V4L2_PIX_FMT_YUV420:
+                                m_planes.push_back({ 0, m_width, 1, 1, 1 });
+                                m_planes.push_back({ lumaSize, m_width/2, 2, 2, 1 });
+                                m_planes.push_back({ lumaSize + lumaSize/4, m_width/2, 2, 2, 1 });
+                                break;
+                }
+                m_size = 0;
+                for (const Plane & plane : m_planes) {
+                        m_size += plane.stride*(m_height/plane.vs);
+                }
+        }
+
+        // bytes of a unit of the plane for a color
+        void unit(int plane, const YuvColor & color, uint8_t* out) {
+                switch (m_format) {
+                        case V4L2_PIX_FMT_YUYV:
+                                out[0] = color.y; out[1] = color.u; out[2] = color.y; out[3] = color.v;
+                                break;
+                        case V4L2_PIX_FMT_UYVY:
+                                out[0] = color.u; out[1] = color.y; out[2] = color.v; out[3] = color.y;
+                                break;
+                        case V4L2_PIX_FMT_RGB24: {
+                                // BT.601 limited range
+                                int c = color.y - 16;
+                                int d = color.u - 128;
+                                int e = color.v - 128;
+                                out[0] = clamp((298*c + 409*e + 128) >> 8);
+                                out[1] = clamp((298*c - 100*d - 208*e + 128) >> 8);
+                                out[2] = clamp((298*c + 516*d + 128) >> 8);
+                                break;
+                        }
+                        case V4L2_PIX_FMT_NV12:
+                                if (plane == 0) {
+                                        out[0] = color.y;
+                                } else {
+                                        out[0] = color.u; out[1] = color.v;
+                                }
+                                break;
+                        case V4L2_PIX_FMT_YUV420:
+                                out[0] = (plane == 0) ? color.y : (plane == 1) ? color.u : color.v;
+                                break;
+                }
+        }
+
+        static uint8_t clamp(int value) {
+                return std::min(std::max(value, 0), 255);
+        }
+
+        // x, y, w and h are even
+        void fillRect(uint8_t* buffer, int x, int y, int w, int h, const YuvColor & color) {
+                if ( (w <= 0) || (h <= 0) ) {
+                        return;
+                }
+                for (size_t p=0; p<m_planes.size(); ++p) {
+                        const Plane & plane = m_planes[p];
+                        uint8_t* first = buffer + plane.offset + (y/plane.vs)*plane.stride + (x/plane.hs)*plane.unitSize;
+                        size_t rowSize = (w/plane.hs)*plane.unitSize;
+                        // write one unit then double the filled part of the row
+                        this->unit(p, color, first);
+                        for (size_t filled = plane.unitSize; filled < rowSize; filled *= 2) {
+                                memcpy(first + filled, first, std::min(filled, rowSize - filled));
+                        }
+                        for (int i=1; i<h/plane.vs; ++i) {
+                                memcpy(first + i*plane.stride, first, rowSize);
+                        }
+                }
+        }
+
+        void restoreRect(const Rect & rect) {
+                for (const Plane & plane : m_planes) {
+                        size_t rowSize = (rect.w/plane.hs)*plane.unitSize;
+                        for (int i=0; i<rect.h/plane.vs; ++i) {
+                                size_t offset = plane.offset + (rect.y/plane.vs + i)*plane.stride + (rect.x/plane.hs)*plane.unitSize;
+                                memcpy(m_frame.data() + offset, m_background.data() + offset, rowSize);
+                        }
+                }
+        }
+
+        // clip to the frame, align on chroma and remember to restore it on next frame
+        bool clip(Rect & rect) {
+                int x0 = std::max(rect.x, 0) & ~1;
+                int y0 = std::max(rect.y, 0) & ~1;
+                int x1 = std::min((std::min(rect.x + rect.w, m_width) + 1) & ~1, m_width);
+                int y1 = std::min((std::min(rect.y + rect.h, m_height) + 1) & ~1, m_height);
+                if ( (x1 <= x0) || (y1 <= y0) ) {
+                        return false;
+                }
+                rect.x = x0;
+                rect.y = y0;
+                rect.w = x1 - x0;
+                rect.h = y1 - y0;
+                m_dirty.push_back(rect);
+                return true;
+        }
+
+        void renderGradient() {
+                // luma ramp on x, chroma ramps on y
+                for (int y=0; y<m_height; y+=2) {
+                        uint8_t u = 16 + (224*y)/m_height;
+                        uint8_t v = 240 - (224*y)/m_height;
+                        for (int x=0; x<m_width; x+=2) {
+                                YuvColor color = { (uint8_t)(16 + (219*x)/m_width), u, v };
+                                this->fillRect(m_background.data(), x, y, 2, 2, color);
+                        }
+                }
+        }
+
+        // SMPTE EG 1 color bars, 75% bars, castellations and PLUGE
+        void renderBars() {
+                static const YuvColor top[] = { {180,128,128}, {168,44,136}, {145,147,44}, {133,63,52}, {63,193,204}, {51,109,212}, {28,212,120} };
+                static const YuvColor middle[] = { {28,212,120}, {16,128,128}, {51,109,212}, {16,128,128}, {63,193,204}, {16,128,128}, {180,128,128} };
+                static const YuvColor bottom[] = { {16,158,95}, {235,128,128}, {16,174,149}, {16,128,128}, {7,128,128}, {16,128,128}, {25,128,128}, {16,128,128} };
+                // bottom row widths in 1/28 of the frame width : -I, white, +Q, black, -4%, black, +4%, black
+                static const int bottomWidth[] = { 5, 5, 5, 5, 1, 1, 1, 5 };
+
+                int topHeight = (m_height*2/3) & ~1;
+                int middleHeight = (m_height/12) & ~1;
+                for (int i=0; i<7; ++i) {
+                        int x0 = (i*m_width/7) & ~1;
+                        int x1 = ((i+1)*m_width/7) & ~1;
+                        this->fillRect(m_background.data(), x0, 0, x1 - x0, topHeight, top[i]);
+                        this->fillRect(m_background.data(), x0, topHeight, x1 - x0, middleHeight, middle[i]);
+                }
+                int x = 0;
+                int end = 0;
+                for (int i=0; i<8; ++i) {
+                        end += bottomWidth[i];
+                        int x1 = (i == 7) ? m_width : ((end*m_width/28) & ~1);
+                        this->fillRect(m_background.data(), x, topHeight + middleHeight, x1 - x, m_height - topHeight - middleHeight, bottom[i]);
+                        x = x1;
+                }
+        }
+
+        // extra rows allow to select a different window on each frame
+        void renderNoise() {
+                m_noise = true;
+                m_background.resize(m_size + m_planes[0].stride*64);
+                std::mt19937 rng(0);
+                for (size_t i=0; i+4<=m_background.size(); i+=4) {
+                        uint32_t value = rng();
+                        memcpy(m_background.data() + i, &value, sizeof(value));
+                }
+        }
+
+        void drawBox(unsigned int index) {
+                int size = std::max(m_height/8, 2);
+                int rangeX = std::max(m_width - size, 1);
+                int rangeY = std::max(m_height - size, 1);
+                // bounce on the borders
+                unsigned int px = (index * std::max(m_width/100, 1)) % (2*rangeX);
+                unsigned int py = (index * std::max(m_height/100, 1)) % (2*rangeY);
+                Rect rect = { (int)std::min(px, 2*rangeX - px), (int)std::min(py, 2*rangeY - py), size, size };
+                if (this->clip(rect)) {
+                        this->fillRect(m_frame.data(), rect.x, rect.y, rect.w, rect.h, white());
+                }
+        }
+
+        void drawCounter(unsigned int index) {
+                // 5x7 digits, one byte per line, msb on the left
+                static const uint8_t font[10][7] = {
+                        { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },
+                        { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },
+                        { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },
+                        { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },
+                        { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },
+                        { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },
+                        { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },
+                        { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+                        { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },
+                        { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },
+                };
+                char text[16];
+                int len = snprintf(text, sizeof(text), "%08u", index);
+                int scale = std::max(m_height/120, 2) & ~1;
+                Rect rect = { scale, scale, (len*6 + 1)*scale, 9*scale };
+                if (!this->clip(rect)) {
+                        return;
+                }
+                this->fillRect(m_frame.data(), rect.x, rect.y, rect.w, rect.h, black());
+                for (int c=0; c<len; ++c) {
+                        for (int line=0; line<7; ++line) {
+                                uint8_t bits = font[text[c] - '0'][line];
+                                for (int b=0; b<5; ++b) {
+                                        int x = rect.x + (c*6 + b + 1)*scale;
+                                        int y = rect.y + (line + 1)*scale;
+                                        if ( (bits & (0x10 >> b)) && (x + scale <= rect.x + rect.w) && (y + scale <= rect.y + rect.h) ) {
+                                                this->fillRect(m_frame.data(), x, y, scale, scale, white());
+                                        }
+                                }
+                        }
+                }
+        }
+
+        void drawStamp(const FrameStamp & stamp) {
+                int block = FrameStamp::blockSize(m_width, m_height);
+                Rect rect = { 0, m_height - FrameStamp::rows*block, FrameStamp::columns*block, FrameStamp::rows*block };
+                if ( (block == 0) || !this->clip(rect) ) {
+                        return;
+                }
+                for (int row=0; row<FrameStamp::rows; ++row) {
+                        for (int column=0; column<FrameStamp::columns; ++column) {
+                                this->fillRect(m_frame.data(), column*block, rect.y + row*block, block, block, stamp.bit(column, row) ? white() : black());
+                        }
+                }
+        }
+
+    protected:
+        int                  m_format;
+        int                  m_width;
+        int                  m_height;
+        bool                 m_noise;
+        bool                 m_box;
+        bool                 m_counter;
+        bool                 m_stamp;
+        bool                 m_valid;
+        size_t               m_size;
+        std::vector<Plane>   m_planes;
+        std::vector<uint8_t> m_background;
+        std::vector<uint8_t> m_frame;
+        std::vector<Rect>    m_dirty;
+        std::minstd_rand     m_rng;
+
+        // function local constants, a static constexpr member used by reference is only defined inline since C++17
+        static const YuvColor & black() {
+                static const YuvColor color = { 16, 128, 128 };
+                return color;
+        }
+        static const YuvColor & white() {
+                static const YuvColor color = { 235, 128, 128 };
+                return color;
+        }
+};
@@ -0,0 +1,238 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** roimap.h
+**
+** Regions of interest of a frame with a quantizer offset :
+**  - RoiMap gives per block offsets (x264, x265) or segments (libvpx)
+**  - RoiMetadataReader follows the JSON lines written by v4l2detect_yuv -m
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+
+#include "logger.h"
+
+class RoiMap {
+    public:
+        // negative offsets improve the quality, background applies outside the regions
+        struct Region {
+                int x, y, width, height;
+                int offset;
+        };
+
+        RoiMap(int width = 0, int height = 0, int background = 0) : m_width(width), m_height(height), m_background(background) {}
+
+        void add(int x, int y, int width, int height, int offset) {
+                Region region = { x, y, width, height, offset };
+                m_regions.push_back(region);
+        }
+
+        bool empty() const { return m_regions.empty() && (m_background == 0); }
+
+        int getWidth() const  { return m_width;  }
+        int getHeight() const { return m_height; }
+
+        // offset of each block in raster order, a block takes the lowest offset of the regions it touches
+        std::vector<float> offsets(int blockSize) const {
+                std::vector<int> blocks = this->blockOffsets(blockSize);
+                return std::vector<float>(blocks.begin(), blocks.end());
+        }
+
+        // segment of each block, segment 0 is the background, at most maxSegments offsets
+        void segments(int blockSize, int maxSegments, std::vector<uint8_t> & map, std::vector<int> & segmentOffsets) const {
+                std::vector<int> blocks = this->blockOffsets(blockSize);
+                segmentOffsets.assign(1, m_background);
+                map.assign(blocks.size(), 0);
+                for (size_t i = 0; i < blocks.size(); ++i) {
+                        std::vector<int>::iterator it = std::find(segmentOffsets.begin(), segmentOffsets.end(), blocks[i]);
+                        if (it == segmentOffsets.end()) {
+                                if ((int)segmentOffsets.size() < maxSegments) {
+                                        it = segmentOffsets.insert(segmentOffsets.end(), blocks[i]);
+                                } else {
+                                        // no segment left, share the closest one
+                                        it = segmentOffsets.begin();
+                                        for (std::vector<int>::iterator s = segmentOffsets.begin(); s != segmentOffsets.end(); ++s) {
+                                                if (abs(*s - blocks[i]) < abs(*it - blocks[i])) {
+                                                        it = s;
+                                                }
+                                        }
+                                }
+                        }
+                        map[i] = it - segmentOffsets.begin();
+                }
+        }
+
+    protected:
+        std::vector<int> blockOffsets(int blockSize) const {
+                int cols = (m_width + blockSize - 1) / blockSize;
+                int rows = (m_height + blockSize - 1) / blockSize;
+                std::vector<int> blocks(cols * rows, m_background);
+                std::vector<bool> inRegion(cols * rows, false);
+                for (const Region & r : m_regions) {
+                        int x0 = std::max(0, r.x / blockSize);
+                        int y0 = std::max(0, r.y / blockSize);
+                        int x1 = std::min(cols, (r.x + r.width + blockSize - 1) / blockSize);
+                        int y1 = std::min(rows, (r.y + r.height + blockSize - 1) / blockSize);
+                        for (int y = y0; y < y1; ++y) {
+                                for (int x = x0; x < x1; ++x) {
+                                        int& block = blocks[y*cols + x];
+                                        block = inRegion[y*cols + x] ? std::min(block, r.offset) : r.offset;
+                                        inRegion[y*cols + x] = true;
+                                }
+                        }
+                }
+                return blocks;
+        }
+
+    protected:
+        int                 m_width;
+        int                 m_height;
+        int                 m_background;
+        std::vector<Region> m_regions;
+};
+
+// follow a file or a fifo of JSON lines, one line per frame with its objects
+class RoiMetadataReader {
+    public:
+        struct Entry {
+                long long         frame;
+                long long         sequence;   // FrameStamp sequence, -1 when the frame was not stamped
+                int               width;
+                int               height;
+                std::vector<RoiMap::Region> objects;
+        };
+
+        RoiMetadataReader(const std::string & path, size_t history = 256) : m_history(history), m_stop(false) {
+                m_fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK);
+                if (m_fd == -1) {
+                        LOG(WARN) << "Cannot open metadata:" << path << " " << strerror(errno);
+                } else {
+                        m_thread = std::thread(&RoiMetadataReader::run, this);
+                }
+        }
+
+        virtual ~RoiMetadataReader() {
+                m_stop = true;
+                if (m_thread.joinable()) {
+                        m_thread.join();
+                }
+                if (m_fd != -1) {
+                        ::close(m_fd);
+                }
+        }
+
+        bool isValid() { return m_fd != -1; }
+
+        // objects of a stamped frame, the latest ones otherwise or when the sequence is not known yet
+        bool getObjects(long long sequence, Entry & entry) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_entries.empty()) {
+                        return false;
+                }
+                entry = m_entries.back();
+                if (sequence >= 0) {
+                        for (std::deque<Entry>::reverse_iterator it = m_entries.rbegin(); it != m_entries.rend(); ++it) {
+                                if ( (it->sequence >= 0) && (it->sequence <= sequence) ) {
+                                        entry = *it;
+                                        break;
+                                }
+                        }
+                }
+                return true;
+        }
+
+        // parse a line written by ObjectTracker::writeJson
+        static bool parse(const std::string & line, Entry & entry) {
+                long long value = 0;
+                if (!number(line, "frame", 0, line.size(), entry.frame)) {
+                        return false;
+                }
+                entry.sequence = number(line, "sequence", 0, line.size(), value) ? value : -1;
+                entry.width = number(line, "width", 0, line.size(), value) ? value : 0;
+                entry.height = number(line, "height", 0, line.size(), value) ? value : 0;
+                entry.objects.clear();
+                size_t pos = line.find("\"objects\":[");
+                while (pos != std::string::npos) {
+                        size_t begin = line.find('{', pos);
+                        size_t end = (begin == std::string::npos) ? std::string::npos : line.find('}', begin);
+                        if (end == std::string::npos) {
+                                break;
+                        }
+                        long long x = 0, y = 0, w = 0, h = 0;
+                        if (number(line, "x", begin, end, x) && number(line, "y", begin, end, y) && number(line, "w", begin, end, w) && number(line, "h", begin, end, h)) {
+                                RoiMap::Region region = { (int)x, (int)y, (int)w, (int)h, 0 };
+                                entry.objects.push_back(region);
+                        }
+                        pos = end;
+                }
+                return true;
+        }
+
+    protected:
+        static bool number(const std::string & line, const char* key, size_t begin, size_t end, long long & value) {
+                std::string pattern = std::string("\"") + key + "\":";
+                size_t pos = line.find(pattern, begin);
+                if ( (pos == std::string::npos) || (pos >= end) ) {
+                        return false;
+                }
+                value = strtoll(line.c_str() + pos + pattern.size(), NULL, 10);
+                return true;
+        }
+
+        void run() {
+                std::string pending;
+                char buffer[4096];
+                while (!m_stop) {
+                        struct pollfd pfd = { m_fd, POLLIN, 0 };
+                        int ret = poll(&pfd, 1, 100);
+                        ssize_t size = (ret > 0) ? ::read(m_fd, buffer, sizeof(buffer)) : 0;
+                        if (size <= 0) {
+                                // end of a growing file or a fifo without writer
+                                if (ret > 0) {
+                                        usleep(20000);
+                                }
+                                continue;
+                        }
+                        pending.append(buffer, size);
+                        size_t eol;
+                        while ((eol = pending.find('\n')) != std::string::npos) {
+                                Entry entry;
+                                if (parse(pending.substr(0, eol), entry)) {
+                                        std::unique_lock<std::mutex> lock(m_mutex);
+                                        m_entries.push_back(entry);
+                                        if (m_entries.size() > m_history) {
+                                                m_entries.pop_front();
+                                        }
+                                }
+                                pending.erase(0, eol + 1);
+                        }
+                }
+        }
+
+    protected:
+        int               m_fd;
+        size_t            m_history;
+        std::atomic<bool> m_stop;
+        std::deque<Entry> m_entries;
+        std::mutex        m_mutex;
+        std::thread       m_thread;
+};
@@ -0,0 +1,436 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** rtpsink.h
+**
+** Packetize frames in RTP and send them over UDP :
+**  - H264 : RFC 6184 (single NAL unit and FU-A)
+**  - HEVC : RFC 7798 (single NAL unit and FU)
+**  - VP8  : RFC 7741
+**  - VP9  : RFC 9628 (non flexible mode)
+**  - JPEG : RFC 2435
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include "logger.h"
+#include "V4l2Device.h"
+#include "sinkfactory.h"
+#include "nalscanner.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+class RtpSink : public Sink {
+    public:
+        // path is host:port, opt MTU is the maximum RTP packet size (576..65507), PAYLOAD_TYPE overrides the payload type (96..127)
+        static Sink* create(const std::string & path, int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
+                size_t pos = path.find_last_of(':');
+                if (pos == std::string::npos) {
+                        LOG(WARN) << "RTP destination should be host:port " << path;
+                        return NULL;
+                }
+                std::string host = path.substr(0, pos);
+                std::string port = path.substr(pos+1);
+                if ( (host.size() > 2) && (host.front() == '[') && (host.back() == ']') ) {
+                        host = host.substr(1, host.size()-2);
+                }
+
+                struct addrinfo hints;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_DGRAM;
+                struct addrinfo* addr = NULL;
+                int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addr);
+                if (ret != 0) {
+                        LOG(WARN) << "Cannot resolve " << path << " " << gai_strerror(ret);
+                        return NULL;
+                }
+                int fd = socket(addr->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                if ( (fd == -1) || (connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) ) {
+                        LOG(WARN) << "Cannot create socket to " << path << " " << strerror(errno);
+                        if (fd != -1) {
+                                ::close(fd);
+                        }
+                        freeaddrinfo(addr);
+                        return NULL;
+                }
+                freeaddrinfo(addr);
+
+                // the smallest MTU still leaves room for the JPEG headers with 16 bits quantization tables
+                unsigned long long mtu = 1400;
+                unsigned long long payloadType = (format == V4L2_PIX_FMT_JPEG) ? 26 : 96;
+                if ( !SinkFactory::getOption(opt, "MTU", 576, MAX_DATAGRAM, mtu)
+                  || !SinkFactory::getOption(opt, "PAYLOAD_TYPE", 96, 127, payloadType) ) {
+                        ::close(fd);
+                        return NULL;
+                }
+                return new RtpSink(fd, host, port, format, width, height, mtu, payloadType);
+        }
+
+        RtpSink(int fd, const std::string & host, const std::string & port, int format, int width, int height, unsigned int mtu, int payloadType)
+            : Sink(format, width, height), m_fd(fd), m_mtu(mtu), m_payloadType(payloadType), m_gso(false), m_timestamp(0) {
+                std::random_device rd;
+                m_ssrc = rd();
+                m_seq = rd();
+
+#ifdef UDP_SEGMENT
+                // probe UDP generic segmentation offload
+                int segment = 0;
+                m_gso = (setsockopt(m_fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0);
+#endif
+                LOG(NOTICE) << "RTP to " << host << ":" << port << " gso:" << m_gso << " sdp:\n" << this->getSdp(host, port);
+        }
+
+        virtual ~RtpSink() {
+                ::close(m_fd);
+        }
+
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo & info) {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                m_timestamp = ts.tv_sec*90000ULL + ts.tv_nsec/(1000000000/90000);
+
+                m_data.clear();
+                m_packets.clear();
+                const unsigned char* frame = (const unsigned char*)buffer;
+                switch (m_format) {
+                        case V4L2_PIX_FMT_H264:
+                        case V4L2_PIX_FMT_HEVC: this->packetizeAnnexB(frame, size); break;
+                        case V4L2_PIX_FMT_VP8:
+                        case V4L2_PIX_FMT_VP9:  this->packetizeVpx(frame, size, info.keyframe); break;
+                        case V4L2_PIX_FMT_JPEG: this->packetizeJpeg(frame, size); break;
+                        default:
+                                LOG(WARN) << "RTP packetization not supported for " << V4l2Device::fourcc(m_format);
+                                return -1;
+                }
+                if (m_packets.empty()) {
+                        return 0;
+                }
+                // marker on the last packet of the frame
+                m_data[m_packets.back().offset + 1] |= 0x80;
+
+                return this->send() ? size : -1;
+        }
+
+    protected:
+        struct Packet {
+                size_t offset;
+                size_t size;
+        };
+
+        unsigned int maxPayload() {
+                return m_mtu - 12;
+        }
+
+        // RTP header followed by payload header, returns the offset of the payload header
+        size_t startPacket() {
+                size_t offset = m_data.size();
+                m_packets.push_back({ offset, 12 });
+                m_data.resize(offset + 12);
+                unsigned char* hdr = &m_data[offset];
+                hdr[0] = 0x80;
+                hdr[1] = m_payloadType & 0x7f;
+                hdr[2] = m_seq >> 8;
+                hdr[3] = m_seq & 0xff;
+                hdr[4] = m_timestamp >> 24;
+                hdr[5] = m_timestamp >> 16;
+                hdr[6] = m_timestamp >> 8;
+                hdr[7] = m_timestamp;
+                hdr[8] = m_ssrc >> 24;
+                hdr[9] = m_ssrc >> 16;
+                hdr[10] = m_ssrc >> 8;
+                hdr[11] = m_ssrc;
+                m_seq++;
+                return m_data.size();
+        }
+
+        void append(const unsigned char* data, size_t size) {
+                m_data.insert(m_data.end(), data, data + size);
+                m_packets.back().size += size;
+        }
+
+        void packetizeAnnexB(const unsigned char* frame, size_t size) {
+                NalSplitter splitter(frame, size);
+                NalUnit nal;
+                while (splitter.next(nal)) {
+                        this->packetizeNal(splitter.data(nal), nal.size);
+                }
+        }
+
+        void packetizeNal(const unsigned char* nal, size_t size) {
+                if (size <= this->maxPayload()) {
+                        this->startPacket();
+                        this->append(nal, size);
+                        return;
+                }
+                unsigned char fu[3];
+                size_t headerSize = 0;
+                size_t fuSize = 0;
+                if (m_format == V4L2_PIX_FMT_H264) {
+                        // FU-A indicator + FU header
+                        headerSize = 1;
+                        fu[0] = (nal[0] & 0xe0) | 28;
+                        fu[1] = nal[0] & 0x1f;
+                        fuSize = 2;
+                } else {
+                        // FU payload header (type 49) + FU header
+                        headerSize = 2;
+                        fu[0] = (nal[0] & 0x81) | (49 << 1);
+                        fu[1] = nal[1];
+                        fu[2] = (nal[0] >> 1) & 0x3f;
+                        fuSize = 3;
+                }
+                size_t offset = headerSize;
+                size_t chunkSize = this->maxPayload() - fuSize;
+                while (offset < size) {
+                        size_t len = std::min(chunkSize, size - offset);
+                        unsigned char flags = 0;
+                        if (offset == headerSize) {
+                                flags |= 0x80;
+                        }
+                        if (offset + len == size) {
+                                flags |= 0x40;
+                        }
+                        this->startPacket();
+                        fu[fuSize-1] = (fu[fuSize-1] & 0x3f) | flags;
+                        this->append(fu, fuSize);
+                        this->append(nal + offset, len);
+                        offset += len;
+                }
+        }
+
+        void packetizeVpx(const unsigned char* frame, size_t size, bool keyframe) {
+                size_t chunkSize = this->maxPayload() - 1;
+                size_t offset = 0;
+                while (offset < size) {
+                        size_t len = std::min(chunkSize, size - offset);
+                        unsigned char descriptor = 0;
+                        if (m_format == V4L2_PIX_FMT_VP8) {
+                                // S : start of partition
+                                if (offset == 0) {
+                                        descriptor |= 0x10;
+                                }
+                        } else {
+                                // P : inter predicted, B : begin of frame, E : end of frame
+                                if (!keyframe) {
+                                        descriptor |= 0x40;
+                                }
+                                if (offset == 0) {
+                                        descriptor |= 0x08;
+                                }
+                                if (offset + len == size) {
+                                        descriptor |= 0x04;
+                                }
+                        }
+                        this->startPacket();
+                        this->append(&descriptor, 1);
+                        this->append(frame + offset, len);
+                        offset += len;
+                }
+        }
+
+        void packetizeJpeg(const unsigned char* frame, size_t size) {
+                const unsigned char* p = frame;
+                const unsigned char* end = frame + size;
+                const unsigned char* scan = NULL;
+                std::vector<unsigned char> qtables;
+                int type = -1;
+                int width = 0;
+                int height = 0;
+                unsigned int restartInterval = 0;
+
+                // parse markers up to the start of scan
+                if ( (size < 4) || (p[0] != 0xff) || (p[1] != 0xd8) ) {
+                        LOG(WARN) << "RTP JPEG not a JPEG frame";
+                        return;
+                }
+                p += 2;
+                while (!scan && (end - p >= 4) && (p[0] == 0xff)) {
+                        unsigned char marker = p[1];
+                        size_t len = (p[2] << 8) | p[3];
+                        const unsigned char* seg = p + 4;
+                        if ( (len < 2) || (seg + len - 2 > end) ) {
+                                break;
+                        }
+                        switch (marker) {
+                                case 0xdb: // DQT
+                                        for (const unsigned char* q = seg; q + 65 <= seg + len - 2; q += 65) {
+                                                if (q[0] >> 4) {
+                                                        LOG(WARN) << "RTP JPEG 16 bits quantization table not supported";
+                                                        return;
+                                                }
+                                                qtables.insert(qtables.end(), q + 1, q + 65);
+                                        }
+                                        break;
+                                case 0xc0: // SOF0
+                                        if (len >= 17) {
+                                                height = (seg[1] << 8) | seg[2];
+                                                width = (seg[3] << 8) | seg[4];
+                                                if ( (seg[5] == 3) && (seg[7] == 0x21) ) {
+                                                        type = 0;
+                                                } else if ( (seg[5] == 3) && (seg[7] == 0x22) ) {
+                                                        type = 1;
+                                                }
+                                        }
+                                        break;
+                                case 0xdd: // DRI
+                                        restartInterval = (seg[0] << 8) | seg[1];
+                                        break;
+                                case 0xda: // SOS
+                                        scan = seg + len - 2;
+                                        break;
+                        }
+                        p = seg + len - 2;
+                }
+                if (!scan || (type < 0) || (width > 2040) || (height > 2040)) {
+                        LOG(WARN) << "RTP JPEG only baseline 4:2:0 or 4:2:2 up to 2040x2040 is supported";
+                        return;
+                }
+                if ( (end - scan >= 2) && (end[-2] == 0xff) && (end[-1] == 0xd9) ) {
+                        end -= 2;
+                }
+                if (restartInterval) {
+                        type += 64;
+                }
+
+                size_t scanSize = end - scan;
+                size_t offset = 0;
+                while (offset < scanSize) {
+                        this->startPacket();
+                        unsigned char header[8] = { 0, (unsigned char)(offset >> 16), (unsigned char)(offset >> 8), (unsigned char)offset,
+                                                    (unsigned char)type, 255, (unsigned char)(width/8), (unsigned char)(height/8) };
+                        this->append(header, sizeof(header));
+                        size_t headerSize = sizeof(header);
+                        if (restartInterval) {
+                                // fragments are not aligned on restart intervals : F=1 L=1 count=0x3fff
+                                unsigned char restart[4] = { (unsigned char)(restartInterval >> 8), (unsigned char)restartInterval, 0xff, 0xff };
+                                this->append(restart, sizeof(restart));
+                                headerSize += sizeof(restart);
+                        }
+                        if (offset == 0) {
+                                unsigned char qheader[4] = { 0, 0, (unsigned char)(qtables.size() >> 8), (unsigned char)qtables.size() };
+                                this->append(qheader, sizeof(qheader));
+                                this->append(qtables.data(), qtables.size());
+                                headerSize += sizeof(qheader) + qtables.size();
+                        }
+                        size_t len = std::min(this->maxPayload() - headerSize, scanSize - offset);
+                        this->append(scan + offset, len);
+                        offset += len;
+                }
+        }
+
+        // send the packets of the frame from the first one, consecutive packets of the same size are grouped using GSO
+        // a group is one UDP datagram for the kernel, it cannot carry more than MAX_DATAGRAM bytes
+        bool send(size_t first = 0) {
+                std::vector<struct mmsghdr> msgs;
+                std::vector<size_t> msgPacket;
+                std::vector<struct iovec> iovs(m_packets.size());
+                size_t nbControl = m_gso ? m_packets.size() : 0;
+                std::vector<char> control(nbControl * CMSG_SPACE(sizeof(uint16_t)));
+                for (size_t i = first; i < m_packets.size(); ) {
+                        size_t segment = m_packets[i].size;
+                        size_t j = i + 1;
+                        size_t len = segment;
+                        if (m_gso) {
+                                while ( (j < m_packets.size()) && (j - i < MAX_SEGMENTS) && (len + m_packets[j].size <= MAX_DATAGRAM) && (m_packets[j-1].size == segment) && (m_packets[j].size <= segment) ) {
+                                        len += m_packets[j].size;
+                                        j++;
+                                }
+                        }
+                        struct mmsghdr msg;
+                        memset(&msg, 0, sizeof(msg));
+                        iovs[msgs.size()].iov_base = &m_data[m_packets[i].offset];
+                        iovs[msgs.size()].iov_len = len;
+                        msg.msg_hdr.msg_iov = &iovs[msgs.size()];
+                        msg.msg_hdr.msg_iovlen = 1;
+#ifdef UDP_SEGMENT
+                        if (j - i > 1) {
+                                char* ctrl = &control[msgs.size() * CMSG_SPACE(sizeof(uint16_t))];
+                                msg.msg_hdr.msg_control = ctrl;
+                                msg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                                struct cmsghdr* cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+                                cm->cmsg_level = SOL_UDP;
+                                cm->cmsg_type = UDP_SEGMENT;
+                                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                                uint16_t gsoSize = segment;
+                                memcpy(CMSG_DATA(cm), &gsoSize, sizeof(gsoSize));
+                        }
+#endif
+                        msgs.push_back(msg);
+                        msgPacket.push_back(i);
+                        i = j;
+                }
+
+                size_t sent = 0;
+                while (sent < msgs.size()) {
+                        int ret = sendmmsg(m_fd, &msgs[sent], msgs.size() - sent, 0);
+                        if (ret < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                if (m_gso && (errno == EIO || errno == EINVAL)) {
+                                        // no segmentation offload on this route, resend what is not sent yet
+                                        LOG(NOTICE) << "RTP disable gso " << strerror(errno);
+                                        m_gso = false;
+                                        return this->send(msgPacket[sent]);
+                                }
+                                LOG(WARN) << "RTP send error " << strerror(errno);
+                                return false;
+                        }
+                        sent += ret;
+                }
+                return true;
+        }
+
+        std::string getSdp(const std::string & host, const std::string & port) {
+                std::string ipver = (host.find(':') == std::string::npos) ? "IP4" : "IP6";
+                std::string sdp = "v=0\no=- 0 0 IN " + ipver + " " + host + "\ns=v4l2tools\nc=IN " + ipver + " " + host + "\nt=0 0\n";
+                sdp += "m=video " + port + " RTP/AVP " + std::to_string(m_payloadType) + "\n";
+                switch (m_format) {
+                        case V4L2_PIX_FMT_H264: sdp += "a=rtpmap:" + std::to_string(m_payloadType) + " H264/90000\na=fmtp:" + std::to_string(m_payloadType) + " packetization-mode=1\n"; break;
+                        case V4L2_PIX_FMT_HEVC: sdp += "a=rtpmap:" + std::to_string(m_payloadType) + " H265/90000\n"; break;
+                        case V4L2_PIX_FMT_VP8:  sdp += "a=rtpmap:" + std::to_string(m_payloadType) + " VP8/90000\n"; break;
+                        case V4L2_PIX_FMT_VP9:  sdp += "a=rtpmap:" + std::to_string(m_payloadType) + " VP9/90000\n"; break;
+                        case V4L2_PIX_FMT_JPEG: sdp += "a=rtpmap:" + std::to_string(m_payloadType) + " JPEG/90000\n"; break;
+                }
+                return sdp;
+        }
+
+    protected:
+        static const size_t        MAX_SEGMENTS = 64;
+        static const size_t        MAX_DATAGRAM = 65507;
+
+        int                        m_fd;
+        unsigned int               m_mtu;
+        int                        m_payloadType;
+        bool                       m_gso;
+        uint32_t                   m_ssrc;
+        uint16_t                   m_seq;
+        uint32_t                   m_timestamp;
+        std::vector<unsigned char> m_data;
+        std::vector<Packet>        m_packets;
+
+    public:
+        static const bool registration;
+};
+
+const bool RtpSink::registration = SinkFactory::get().registerSink("rtp", RtpSink::create);
@@ -0,0 +1,400 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** shmsink.h
+**
+** Publish frames in a ring of slots stored in a memfd.
+** Readers connect to a unix socket and receive the memfd and an eventfd
+** signaled for each frame, slots are read in place without copy.
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <list>
+#include <new>
+#include <cstddef>
+#include <algorithm>
+
+#include "logger.h"
+#include "sinkfactory.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#define SHM_MAGIC   0x324c3456  // V4L2
+#define SHM_VERSION 1
+
+struct ShmHeader {
+        uint32_t              magic;
+        uint32_t              version;
+        uint32_t              format;
+        uint32_t              width;
+        uint32_t              height;
+        uint32_t              slotCount;
+        uint32_t              slotSize;       // size of a slot including its ShmSlot header
+        uint32_t              reserved;
+        std::atomic<uint64_t> sequence;       // sequence of the last published frame
+};
+
+struct ShmSlot {
+        std::atomic<uint64_t> sequence;       // 0 while the slot is written
+        uint64_t              timestamp;      // CLOCK_MONOTONIC in microseconds
+        uint32_t              size;
+        uint32_t              keyframe;
+};
+
+inline ShmSlot* shmSlot(ShmHeader* header, uint64_t sequence) {
+        return (ShmSlot*)((char*)header + sizeof(ShmHeader) + (sequence % header->slotCount) * header->slotSize);
+}
+
+// unix socket address, a path not starting with / is in the abstract namespace
+inline socklen_t shmAddress(const std::string & path, struct sockaddr_un & addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        size_t offset = (path[0] == '/') ? 0 : 1;
+        size_t len = std::min(path.size(), sizeof(addr.sun_path) - 1 - offset);
+        memcpy(addr.sun_path + offset, path.c_str(), len);
+        return offsetof(struct sockaddr_un, sun_path) + offset + len;
+}
+
+class ShmSink : public Sink {
+    public:
+        // path is the unix socket, opt SHM_SLOTS is the number of frames in the ring (2..1024), SHM_SLOT_SIZE the maximum frame size (up to 1GB)
+        static Sink* create(const std::string & path, int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
+                unsigned long long slots = 4;
+                // large enough for any raw format
+                unsigned long long slotSize = width * height * 4;
+                if ( !SinkFactory::getOption(opt, "SHM_SLOTS", 2, 1024, slots)
+                  || !SinkFactory::getOption(opt, "SHM_SLOT_SIZE", 1, 1024*1024*1024ULL, slotSize) ) {
+                        return NULL;
+                }
+                ShmSink* sink = new ShmSink(path, format, width, height, slots, slotSize);
+                if (!sink->isReady()) {
+                        delete sink;
+                        sink = NULL;
+                }
+                return sink;
+        }
+
+        ShmSink(const std::string & path, int format, int width, int height, unsigned int slots, unsigned int slotSize)
+            : Sink(format, width, height), m_path(path), m_memfd(-1), m_listenfd(-1), m_header(NULL), m_size(0) {
+                slotSize = (sizeof(ShmSlot) + slotSize + 63) & ~63;
+                m_size = sizeof(ShmHeader) + (size_t)slots * slotSize;
+
+                m_memfd = memfd_create(path.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+                if ( (m_memfd == -1) || (ftruncate(m_memfd, m_size) != 0) ) {
+                        LOG(WARN) << "Cannot create memfd " << strerror(errno);
+                        return;
+                }
+                void* ptr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+                if (ptr == MAP_FAILED) {
+                        LOG(WARN) << "Cannot map memfd " << strerror(errno);
+                        return;
+                }
+                // only the mapping of the writer stays writable, readers cannot map or write the memfd they receive
+                if (fcntl(m_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) != 0) {
+                        LOG(WARN) << "Cannot seal memfd " << strerror(errno);
+                        munmap(ptr, m_size);
+                        return;
+                }
+                m_header = new (ptr) ShmHeader();
+                m_header->magic = SHM_MAGIC;
+                m_header->version = SHM_VERSION;
+                m_header->format = format;
+                m_header->width = width;
+                m_header->height = height;
+                m_header->slotCount = slots;
+                m_header->slotSize = slotSize;
+                m_header->sequence = 0;
+                for (unsigned int i=0; i<slots; ++i) {
+                        new (shmSlot(m_header, i)) ShmSlot();
+                }
+
+                struct sockaddr_un addr;
+                socklen_t addrlen = shmAddress(path, addr);
+                if (path[0] == '/') {
+                        unlink(path.c_str());
+                }
+                m_listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if ( (m_listenfd == -1) || (bind(m_listenfd, (struct sockaddr*)&addr, addrlen) != 0) || (listen(m_listenfd, 16) != 0) ) {
+                        LOG(WARN) << "Cannot listen on " << path << " " << strerror(errno);
+                        if (m_listenfd != -1) {
+                                ::close(m_listenfd);
+                                m_listenfd = -1;
+                        }
+                        return;
+                }
+                // connecting needs write permission on a socket file, the abstract namespace relies on the peer check
+                if ( (path[0] == '/') && (chmod(path.c_str(), 0660) != 0) ) {
+                        LOG(WARN) << "Cannot set mode of " << path << " " << strerror(errno);
+                }
+                LOG(NOTICE) << "Shared memory ring on " << path << " slots:" << slots << " slot size:" << slotSize;
+        }
+
+        virtual ~ShmSink() {
+                for (const Client & client : m_clients) {
+                        ::close(client.sock);
+                        ::close(client.eventfd);
+                }
+                if (m_listenfd != -1) {
+                        ::close(m_listenfd);
+                        if (m_path[0] == '/') {
+                                unlink(m_path.c_str());
+                        }
+                }
+                if (m_header) {
+                        munmap(m_header, m_size);
+                }
+                if (m_memfd != -1) {
+                        ::close(m_memfd);
+                }
+        }
+
+        bool isReady() {
+                return (m_header != NULL) && (m_listenfd != -1);
+        }
+
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo & info) {
+                this->acceptClients();
+
+                if (size > m_header->slotSize - sizeof(ShmSlot)) {
+                        LOG(WARN) << "Frame size:" << size << " exceed shared memory slot size";
+                        return -1;
+                }
+
+                uint64_t sequence = m_header->sequence.load(std::memory_order_relaxed) + 1;
+                ShmSlot* slot = shmSlot(m_header, sequence);
+                slot->sequence.store(0, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                slot->timestamp = ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+                slot->size = size;
+                slot->keyframe = info.keyframe;
+                memcpy((char*)slot + sizeof(ShmSlot), buffer, size);
+
+                slot->sequence.store(sequence, std::memory_order_release);
+                m_header->sequence.store(sequence, std::memory_order_release);
+
+                this->notifyClients();
+                return size;
+        }
+
+    protected:
+        struct Client {
+                int sock;
+                int eventfd;
+        };
+
+        void acceptClients() {
+                int sock;
+                while ( (sock = accept4(m_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1 ) {
+                        if (!this->isAllowed(sock)) {
+                                ::close(sock);
+                                continue;
+                        }
+                        int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                        if ( (efd == -1) || !this->sendFds(sock, efd) ) {
+                                LOG(WARN) << "Cannot send shared memory to client " << strerror(errno);
+                                ::close(sock);
+                                if (efd != -1) {
+                                        ::close(efd);
+                                }
+                                continue;
+                        }
+                        LOG(NOTICE) << "Shared memory client connected on " << m_path;
+                        m_clients.push_back({ sock, efd });
+                }
+        }
+
+        // like a 0660 file : root, the user or the group of the writer
+        bool isAllowed(int sock) {
+                struct ucred cred;
+                socklen_t len = sizeof(cred);
+                if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+                        LOG(WARN) << "Cannot get credentials of shared memory client " << strerror(errno);
+                        return false;
+                }
+                bool allowed = (cred.uid == 0) || (cred.uid == geteuid()) || (cred.gid == getegid());
+                if (!allowed) {
+                        LOG(WARN) << "Shared memory client refused on " << m_path << " pid:" << cred.pid << " uid:" << cred.uid << " gid:" << cred.gid;
+                }
+                return allowed;
+        }
+
+        // memfd and eventfd are sent as SCM_RIGHTS
+        bool sendFds(int sock, int efd) {
+                int fds[2] = { m_memfd, efd };
+                char control[CMSG_SPACE(sizeof(fds))];
+                memset(control, 0, sizeof(control));
+                uint32_t size = m_size;
+                struct iovec iov = { &size, sizeof(size) };
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+                cm->cmsg_level = SOL_SOCKET;
+                cm->cmsg_type = SCM_RIGHTS;
+                cm->cmsg_len = CMSG_LEN(sizeof(fds));
+                memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+                return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(size);
+        }
+
+        void notifyClients() {
+                for (auto it = m_clients.begin(); it != m_clients.end(); ) {
+                        struct pollfd pfd = { it->sock, POLLIN, 0 };
+                        if ( (poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLHUP | POLLERR | POLLIN)) ) {
+                                LOG(NOTICE) << "Shared memory client disconnected from " << m_path;
+                                ::close(it->sock);
+                                ::close(it->eventfd);
+                                it = m_clients.erase(it);
+                                continue;
+                        }
+                        uint64_t value = 1;
+                        if (::write(it->eventfd, &value, sizeof(value)) != sizeof(value)) {
+                                LOG(DEBUG) << "eventfd " << strerror(errno);
+                        }
+                        ++it;
+                }
+        }
+
+    protected:
+        std::string       m_path;
+        int               m_memfd;
+        int               m_listenfd;
+        ShmHeader*        m_header;
+        size_t            m_size;
+        std::list<Client> m_clients;
+
+    public:
+        static const bool registration;
+};
+
+const bool ShmSink::registration = SinkFactory::get().registerSink("shm", ShmSink::create);
+
+// client side of ShmSink
+class ShmReader {
+    public:
+        ShmReader(const std::string & path) : m_sock(-1), m_eventfd(-1), m_header(NULL), m_size(0), m_sequence(0) {
+                struct sockaddr_un addr;
+                socklen_t addrlen = shmAddress(path, addr);
+                m_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+                if ( (m_sock == -1) || (connect(m_sock, (struct sockaddr*)&addr, addrlen) != 0) ) {
+                        LOG(WARN) << "Cannot connect to " << path << " " << strerror(errno);
+                        return;
+                }
+
+                int fds[2] = { -1, -1 };
+                char control[CMSG_SPACE(sizeof(fds))];
+                uint32_t size = 0;
+                struct iovec iov = { &size, sizeof(size) };
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(m_sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(size)) {
+                        LOG(WARN) << "Cannot receive shared memory from " << path << " " << strerror(errno);
+                        return;
+                }
+                struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+                if ( !cm || (cm->cmsg_type != SCM_RIGHTS) || (cm->cmsg_len != CMSG_LEN(sizeof(fds))) ) {
+                        LOG(WARN) << "Unexpected message from " << path;
+                        return;
+                }
+                memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+                m_eventfd = fds[1];
+                void* ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fds[0], 0);
+                ::close(fds[0]);
+                if (ptr == MAP_FAILED) {
+                        LOG(WARN) << "Cannot map shared memory " << strerror(errno);
+                        return;
+                }
+                m_header = (ShmHeader*)ptr;
+                m_size = size;
+                if ( (m_header->magic != SHM_MAGIC) || (m_header->version != SHM_VERSION) ) {
+                        LOG(WARN) << "Unexpected shared memory version";
+                        munmap(ptr, size);
+                        m_header = NULL;
+                        return;
+                }
+                m_sequence = m_header->sequence.load(std::memory_order_acquire);
+        }
+
+        ~ShmReader() {
+                if (m_header) {
+                        munmap(m_header, m_size);
+                }
+                if (m_eventfd != -1) {
+                        ::close(m_eventfd);
+                }
+                if (m_sock != -1) {
+                        ::close(m_sock);
+                }
+        }
+
+        bool isReady() { return m_header != NULL; }
+        int getFormat() { return m_header->format; }
+        int getWidth()  { return m_header->width;  }
+        int getHeight() { return m_header->height; }
+
+        // wait for a frame, returns the slot of the oldest frame not yet read, NULL on timeout
+        const ShmSlot* next(int timeoutMs) {
+                uint64_t last = m_header->sequence.load(std::memory_order_acquire);
+                while (last == m_sequence) {
+                        // the eventfd may count frames that were already read
+                        struct pollfd pfd = { m_eventfd, POLLIN, 0 };
+                        if (poll(&pfd, 1, timeoutMs) <= 0) {
+                                return NULL;
+                        }
+                        uint64_t value;
+                        if ( (::read(m_eventfd, &value, sizeof(value)) != sizeof(value)) && (errno != EAGAIN) ) {
+                                return NULL;
+                        }
+                        last = m_header->sequence.load(std::memory_order_acquire);
+                }
+                // skip frames already overwritten by the writer
+                uint64_t oldest = (last + 2 > m_header->slotCount) ? last + 2 - m_header->slotCount : 1;
+                m_sequence = std::min(last, std::max(m_sequence + 1, oldest));
+                return shmSlot(m_header, m_sequence);
+        }
+
+        // the slot content is valid only if its sequence did not change while it was used
+        bool isValid(const ShmSlot* slot) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return slot->sequence.load(std::memory_order_relaxed) == m_sequence;
+        }
+
+        static const char* data(const ShmSlot* slot) {
+                return (const char*)slot + sizeof(ShmSlot);
+        }
+
+    protected:
+        int        m_sock;
+        int        m_eventfd;
+        ShmHeader* m_header;
+        size_t     m_size;
+        uint64_t   m_sequence;
+};
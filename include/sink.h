@@ -0,0 +1,81 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** sink.h
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <list>
+#include <linux/videodev2.h>
+
+struct FrameInfo {
+        FrameInfo(bool keyframe = false) : keyframe(keyframe) {}
+
+        bool keyframe;
+};
+
+class Sink {
+    public:
+        Sink(int format, int width, int height): m_format(format), m_width(width), m_height(height) {}
+        virtual ~Sink() {}
+
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo & info) = 0;
+
+        // size of a raw frame
+        virtual unsigned int getBufferSize() {
+                unsigned int size = m_width * m_height * 2;
+                switch (m_format) {
+                        case V4L2_PIX_FMT_YUV420:
+                        case V4L2_PIX_FMT_YVU420:
+                        case V4L2_PIX_FMT_NV12:
+                        case V4L2_PIX_FMT_NV21:   size = m_width * m_height * 3 / 2; break;
+                        case V4L2_PIX_FMT_RGB24:
+                        case V4L2_PIX_FMT_BGR24:  size = m_width * m_height * 3; break;
+                        case V4L2_PIX_FMT_RGB32:
+                        case V4L2_PIX_FMT_BGR32:  size = m_width * m_height * 4; break;
+                }
+                return size;
+        }
+
+        int getFormat() { return m_format; }
+        int getWidth()  { return m_width;  }
+        int getHeight() { return m_height; }
+
+    protected:
+        int m_format;
+        int m_width;
+        int m_height;
+};
+
+// write the same frame to several sinks
+class SinkList : public Sink {
+    public:
+        SinkList(int format, int width, int height): Sink(format, width, height) {}
+        virtual ~SinkList() {
+                for (Sink* sink : m_sinks) {
+                        delete sink;
+                }
+        }
+
+        void add(Sink* sink) { m_sinks.push_back(sink); }
+        bool empty() { return m_sinks.empty(); }
+
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo & info) {
+                int wsize = 0;
+                for (Sink* sink : m_sinks) {
+                        wsize = sink->write(buffer, size, info);
+                }
+                return wsize;
+        }
+
+        virtual unsigned int getBufferSize() {
+                return m_sinks.empty() ? Sink::getBufferSize() : m_sinks.front()->getBufferSize();
+        }
+
+    private:
+        std::list<Sink*> m_sinks;
+};
@@ -0,0 +1,101 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** sinkfactory.h
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <map>
+#include <list>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include "logger.h"
+#include "sink.h"
+
+typedef Sink* (*sinkCreator)(const std::string & path, int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose);
+
+class SinkFactory {
+    public:
+        // url is scheme://path?key=value&..., an url without scheme uses the default sink
+        // query parameters are options of this sink only (case insensitive), they override the options given to all sinks
+        Sink* Create(const std::string & url, int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
+                Sink* sink = NULL;
+                std::string scheme;
+                std::string path = url;
+                size_t pos = url.find("://");
+                if (pos != std::string::npos) {
+                        scheme = url.substr(0, pos);
+                        path = url.substr(pos+3);
+                }
+                std::map<std::string,std::string> sinkopt = opt;
+                pos = path.find('?');
+                if (!scheme.empty() && (pos != std::string::npos)) {
+                        std::istringstream is(path.substr(pos+1));
+                        path.erase(pos);
+                        std::string keyvalue;
+                        while (std::getline(is, keyvalue, '&')) {
+                                size_t sep = keyvalue.find('=');
+                                std::string key = keyvalue.substr(0, sep);
+                                std::transform(key.begin(), key.end(), key.begin(), ::toupper);
+                                if (!key.empty()) {
+                                        sinkopt[key] = (sep == std::string::npos) ? "" : keyvalue.substr(sep+1);
+                                }
+                        }
+                }
+                auto it = m_registry.find(scheme);
+                if (it != std::end(m_registry)) {
+                        sink = it->second(path, format, width, height, sinkopt, verbose);
+                }
+                return sink;
+        }
+
+        std::list<std::string> SupportedScheme() {
+                std::list<std::string> schemeList;
+                for (auto it : m_registry) {
+                        if (!it.first.empty()) {
+                                schemeList.push_back(it.first);
+                        }
+                }
+                return schemeList;
+        }
+
+        // unsigned integer option of a sink, value is kept when the option is not set, an invalid value is reported
+        static bool getOption(const std::map<std::string,std::string> & opt, const std::string & key, unsigned long long min, unsigned long long max, unsigned long long & value) {
+                auto it = opt.find(key);
+                if (it == opt.end()) {
+                        return true;
+                }
+                const std::string & str = it->second;
+                char* end = NULL;
+                errno = 0;
+                unsigned long long result = strtoull(str.c_str(), &end, 10);
+                if ( str.empty() || (str[0] == '-') || (*end != '\0') || (errno == ERANGE) || (result < min) || (result > max) ) {
+                        LOG(ERROR) << "Invalid sink option " << key << "=" << str << " : not an integer in " << min << ".." << max;
+                        return false;
+                }
+                value = result;
+                return true;
+        }
+
+        static SinkFactory & get() {
+                static SinkFactory instance;
+                return instance;
+        }
+
+        bool registerSink(const std::string & scheme, sinkCreator creator) {
+                m_registry[scheme] = creator;
+                return true;
+        }
+
+    private:
+        std::map<std::string, sinkCreator> m_registry;
+};
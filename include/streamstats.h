@@ -0,0 +1,343 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** streamstats.h
+**
+** Lightweight statistics on compressed frames : bitrate, frame sizes, IDR interval,
+** arrival jitter and frame types, reported as one JSON line per period.
+** Only NAL headers and the start of slice headers are parsed.
+** When frames carry a FrameStamp, latency from the source and lost sequences are added.
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <linux/videodev2.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "nalscanner.h"
+#include "framestamp.h"
+
+// exp-golomb reader on a NAL payload, skipping emulation prevention bytes
+class NalBitReader {
+    public:
+        NalBitReader(const uint8_t* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_bit(0), m_zeros(0), m_current(0), m_error(false) {}
+
+        unsigned int u(int nbBits) {
+                unsigned int value = 0;
+                for (int i=0; i<nbBits; ++i) {
+                        value = (value << 1) | this->bit();
+                }
+                return value;
+        }
+
+        unsigned int ue() {
+                int leadingZeros = 0;
+                while (!m_error && (this->bit() == 0) && (leadingZeros < 31)) {
+                        leadingZeros++;
+                }
+                return ((1U << leadingZeros) - 1) + this->u(leadingZeros);
+        }
+
+        bool error() { return m_error; }
+
+    private:
+        unsigned int bit() {
+                if (m_bit == 0) {
+                        if ( (m_zeros >= 2) && (m_pos < m_size) && (m_data[m_pos] == 3) ) {
+                                m_pos++;
+                                m_zeros = 0;
+                        }
+                        if (m_pos >= m_size) {
+                                m_error = true;
+                                return 0;
+                        }
+                        m_current = m_data[m_pos++];
+                        m_zeros = m_current ? 0 : m_zeros+1;
+                        m_bit = 8;
+                }
+                m_bit--;
+                return (m_current >> m_bit) & 1;
+        }
+
+    private:
+        const uint8_t* m_data;
+        size_t         m_size;
+        size_t         m_pos;
+        int            m_bit;
+        int            m_zeros;
+        uint8_t        m_current;
+        bool           m_error;
+};
+
+class StreamStats {
+    public:
+        enum FrameType { FRAME_UNKNOWN, FRAME_IDR, FRAME_I, FRAME_P, FRAME_B, FRAME_TYPES };
+
+        // latency needs arrival on CLOCK_MONOTONIC, width and height locate the barcode of raw frames
+        StreamStats(int format, bool latency = false, int width = 0, int height = 0, std::ostream & os = std::cout, unsigned long long periodUs = 1000000)
+            : m_format(format), m_latency(latency), m_width(width), m_height(height), m_os(os), m_period(periodUs), m_periodStart(0), m_lastArrival(0), m_frameIndex(0), m_lastIdr(-1), m_started(false), m_lastSequence(0), m_hasSequence(false) {
+                std::fill(m_extraSliceHeaderBits, m_extraSliceHeaderBits + 64, 0);
+                this->reset();
+        }
+
+        ~StreamStats() {
+                this->flush();
+        }
+
+        // add a frame, arrival in microseconds
+        FrameType add(const uint8_t* frame, size_t size, unsigned long long arrival) {
+                if (!m_started) {
+                        m_started = true;
+                        m_periodStart = arrival;
+                } else {
+                        while (arrival >= m_periodStart + m_period) {
+                                this->report(m_period);
+                                m_periodStart += m_period;
+                        }
+                        m_intervals.push_back(arrival - m_lastArrival);
+                }
+                m_lastArrival = arrival;
+
+                FrameType type = this->frameType(frame, size);
+                if (type == FRAME_IDR) {
+                        if (m_lastIdr >= 0) {
+                                m_idrIntervals.push_back(m_frameIndex - m_lastIdr);
+                        }
+                        m_lastIdr = m_frameIndex;
+                }
+                if (m_latency) {
+                        this->addStamp(frame, size, arrival);
+                }
+                m_types[type]++;
+                m_sizes.push_back(size);
+                m_bytes += size;
+                m_frameIndex++;
+                return type;
+        }
+
+        // report the pending period, rates are computed on its elapsed part up to the next expected frame
+        void flush() {
+                if (m_started && !m_sizes.empty()) {
+                        unsigned long long duration = m_period;
+                        if (!m_intervals.empty()) {
+                                duration = std::min(m_period, std::max(m_lastArrival - m_periodStart + m_intervals.back(), 1ULL));
+                        }
+                        this->report(duration);
+                }
+        }
+
+        static const char* typeName(FrameType type) {
+                static const char* names[] = { "unknown", "IDR", "I", "P", "B" };
+                return names[type];
+        }
+
+    protected:
+        void addStamp(const uint8_t* frame, size_t size, unsigned long long arrival) {
+                FrameStamp stamp;
+                if (stamp.extract(m_format, frame, size, m_width, m_height)) {
+                        m_latencies.push_back( (arrival > stamp.timestamp) ? (arrival - stamp.timestamp) : 0 );
+                        if (m_hasSequence && (stamp.sequence > m_lastSequence + 1)) {
+                                m_lost += stamp.sequence - m_lastSequence - 1;
+                        }
+                        m_lastSequence = stamp.sequence;
+                        m_hasSequence = true;
+                }
+        }
+
+        FrameType frameType(const uint8_t* frame, size_t size) {
+                FrameType type = FRAME_UNKNOWN;
+                if ( (m_format == V4L2_PIX_FMT_JPEG) || (m_format == V4L2_PIX_FMT_MJPEG) ) {
+                        type = FRAME_I;
+                } else if ( (m_format == V4L2_PIX_FMT_H264) || (m_format == V4L2_PIX_FMT_HEVC) ) {
+                        NalSplitter splitter(frame, size, m_format == V4L2_PIX_FMT_HEVC);
+                        NalUnit nal;
+                        while ( (type == FRAME_UNKNOWN) && splitter.next(nal) ) {
+                                if (m_format == V4L2_PIX_FMT_H264) {
+                                        type = this->h264Type(nal.type, splitter.data(nal), nal.size);
+                                } else {
+                                        type = this->hevcType(nal.type, splitter.data(nal), nal.size);
+                                }
+                        }
+                }
+                return type;
+        }
+
+        // type of the first slice of the picture
+        FrameType h264Type(int nalType, const uint8_t* nal, size_t size) {
+                FrameType type = FRAME_UNKNOWN;
+                if (nalType == 5) {
+                        type = FRAME_IDR;
+                } else if (nalType == 1) {
+                        NalBitReader reader(nal+1, size-1);
+                        reader.ue(); // first_mb_in_slice
+                        unsigned int sliceType = reader.ue() % 5;
+                        if (!reader.error()) {
+                                static const FrameType types[] = { FRAME_P, FRAME_B, FRAME_I, FRAME_P, FRAME_I };
+                                type = types[sliceType];
+                        }
+                }
+                return type;
+        }
+
+        FrameType hevcType(int nalType, const uint8_t* nal, size_t size) {
+                FrameType type = FRAME_UNKNOWN;
+                if (size < 3) {
+                        return type;
+                }
+                NalBitReader reader(nal+2, size-2);
+                if (nalType == 34) {
+                        // PPS : keep num_extra_slice_header_bits needed to reach slice_type
+                        unsigned int ppsId = reader.ue();
+                        reader.ue(); // pps_seq_parameter_set_id
+                        reader.u(2); // dependent_slice_segments_enabled_flag, output_flag_present_flag
+                        unsigned int extraBits = reader.u(3);
+                        if (!reader.error() && (ppsId < 64)) {
+                                m_extraSliceHeaderBits[ppsId] = extraBits;
+                        }
+                } else if ( (nalType == 19) || (nalType == 20) ) {
+                        type = FRAME_IDR;
+                } else if (nalType <= 21) {
+                        bool firstSlice = reader.u(1);
+                        if (nalType >= 16) {
+                                reader.u(1); // no_output_of_prior_pics_flag
+                        }
+                        unsigned int ppsId = reader.ue();
+                        if (firstSlice && (ppsId < 64)) {
+                                reader.u(m_extraSliceHeaderBits[ppsId]);
+                                unsigned int sliceType = reader.ue();
+                                if (!reader.error() && (sliceType <= 2)) {
+                                        static const FrameType types[] = { FRAME_B, FRAME_P, FRAME_I };
+                                        type = types[sliceType];
+                                }
+                        }
+                }
+                return type;
+        }
+
+        void reset() {
+                m_sizes.clear();
+                m_intervals.clear();
+                m_idrIntervals.clear();
+                m_latencies.clear();
+                m_lost = 0;
+                m_bytes = 0;
+                std::fill(m_types, m_types + FRAME_TYPES, 0);
+        }
+
+        void report(unsigned long long duration) {
+                double seconds = duration / 1e6;
+                m_os << "{\"time\":" << (m_periodStart / 1e6)
+                     << ",\"frames\":" << m_sizes.size()
+                     << ",\"fps\":" << (m_sizes.size() / seconds)
+                     << ",\"bitrate\":" << (unsigned long long)(m_bytes * 8 / seconds);
+
+                if (!m_sizes.empty()) {
+                        std::sort(m_sizes.begin(), m_sizes.end());
+                        m_os << ",\"size\":{\"min\":" << m_sizes.front()
+                             << ",\"avg\":" << (m_bytes / m_sizes.size())
+                             << ",\"p50\":" << percentile(m_sizes, 50)
+                             << ",\"p90\":" << percentile(m_sizes, 90)
+                             << ",\"max\":" << m_sizes.back() << "}";
+                }
+
+                if (!m_intervals.empty()) {
+                        // jitter is the standard deviation of the inter-arrival time
+                        double mean = 0;
+                        for (unsigned long long interval : m_intervals) {
+                                mean += interval;
+                        }
+                        mean /= m_intervals.size();
+                        double variance = 0;
+                        for (unsigned long long interval : m_intervals) {
+                                variance += (interval - mean) * (interval - mean);
+                        }
+                        variance /= m_intervals.size();
+                        m_os << ",\"interval_ms\":{\"avg\":" << (mean / 1000)
+                             << ",\"max\":" << (*std::max_element(m_intervals.begin(), m_intervals.end()) / 1000.0)
+                             << ",\"jitter\":" << (sqrt(variance) / 1000) << "}";
+                }
+
+                if (!m_idrIntervals.empty()) {
+                        m_os << ",\"idr_interval\":" << m_idrIntervals.back();
+                } else if (m_lastIdr >= 0) {
+                        m_os << ",\"frames_since_idr\":" << (m_frameIndex - m_lastIdr);
+                }
+
+                if (!m_latencies.empty()) {
+                        // histogram buckets are upper bounds in milliseconds
+                        std::sort(m_latencies.begin(), m_latencies.end());
+                        unsigned long long sum = 0;
+                        for (unsigned long long latency : m_latencies) {
+                                sum += latency;
+                        }
+                        m_os << ",\"latency_ms\":{\"count\":" << m_latencies.size()
+                             << ",\"min\":" << (m_latencies.front() / 1000.0)
+                             << ",\"avg\":" << (sum / m_latencies.size() / 1000.0)
+                             << ",\"p50\":" << (percentile(m_latencies, 50) / 1000.0)
+                             << ",\"p90\":" << (percentile(m_latencies, 90) / 1000.0)
+                             << ",\"p99\":" << (percentile(m_latencies, 99) / 1000.0)
+                             << ",\"max\":" << (m_latencies.back() / 1000.0)
+                             << ",\"lost\":" << m_lost
+                             << ",\"histogram\":{";
+                        size_t index = 0;
+                        bool first = true;
+                        for (unsigned long long bound = 1; index < m_latencies.size(); bound *= 2) {
+                                size_t count = 0;
+                                while ( (index < m_latencies.size()) && ((m_latencies[index] < bound*1000) || (bound > 4096)) ) {
+                                        count++;
+                                        index++;
+                                }
+                                if (count) {
+                                        m_os << (first ? "" : ",") << "\"" << ((bound > 4096) ? std::string("inf") : std::to_string(bound)) << "\":" << count;
+                                        first = false;
+                                }
+                        }
+                        m_os << "}}";
+                }
+
+                m_os << ",\"types\":{";
+                for (int i=FRAME_IDR; i<FRAME_TYPES; ++i) {
+                        m_os << "\"" << typeName((FrameType)i) << "\":" << m_types[i] << ",";
+                }
+                m_os << "\"" << typeName(FRAME_UNKNOWN) << "\":" << m_types[FRAME_UNKNOWN] << "}}" << std::endl;
+
+                this->reset();
+        }
+
+        template<typename T>
+        static T percentile(const std::vector<T> & sorted, int p) {
+                return sorted[(sorted.size() - 1) * p / 100];
+        }
+
+    protected:
+        int                             m_format;
+        bool                            m_latency;
+        int                             m_width;
+        int                             m_height;
+        std::ostream &                  m_os;
+        unsigned long long              m_period;
+        unsigned long long              m_periodStart;
+        unsigned long long              m_lastArrival;
+        long long                       m_frameIndex;
+        long long                       m_lastIdr;
+        bool                            m_started;
+        int                             m_extraSliceHeaderBits[64];
+
+        std::vector<size_t>             m_sizes;
+        std::vector<unsigned long long> m_intervals;
+        std::vector<long long>          m_idrIntervals;
+        std::vector<unsigned long long> m_latencies;
+        unsigned int                    m_lost;
+        uint32_t                        m_lastSequence;
+        bool                            m_hasSequence;
+        unsigned long long              m_bytes;
+        unsigned int                    m_types[FRAME_TYPES];
+};
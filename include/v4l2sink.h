@@ -0,0 +1,55 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** v4l2sink.h
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "logger.h"
+#include "V4l2Output.h"
+#include "sinkfactory.h"
+
+class V4l2Sink : public Sink {
+    public:
+        static Sink* create(const std::string & path, int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) {
+                V4l2IoType ioType = IOTYPE_MMAP;
+                std::map<std::string,std::string>::const_iterator iotype = opt.find("IOTYPE");
+                if ( (iotype != opt.end()) && (iotype->second == "READWRITE") ) {
+                        ioType = IOTYPE_READWRITE;
+                }
+                V4L2DeviceParameters outparam(path.c_str(), format, width, height, 0, ioType, verbose);
+                V4l2Output* videoOutput = V4l2Output::create(outparam);
+                if (videoOutput == NULL) {
+                        LOG(WARN) << "Cannot create V4L2 output interface for device:" << path;
+                        return NULL;
+                }
+                return new V4l2Sink(videoOutput);
+        }
+
+        V4l2Sink(V4l2Output* videoOutput)
+            : Sink(videoOutput->getFormat(), videoOutput->getWidth(), videoOutput->getHeight()), m_videoOutput(videoOutput) {}
+
+        virtual ~V4l2Sink() {
+                delete m_videoOutput;
+        }
+
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo & info) {
+                return m_videoOutput->write((char*)buffer, size);
+        }
+
+        virtual unsigned int getBufferSize() {
+                return m_videoOutput->getBufferSize();
+        }
+
+    private:
+        V4l2Output* m_videoOutput;
+
+    public:
+        static const bool registration;
+};
+
+const bool V4l2Sink::registration = SinkFactory::get().registerSink("", V4l2Sink::create);
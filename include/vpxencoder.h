@@ -11,6 +11,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 
 #include "libyuv.h"
 #include "logger.h"
@@ -19,13 +21,22 @@
 #include "vpx/vp8cx.h"
 #include "codecfactory.h"
 
-class V4l2Output;
-
 class VpxEncoder : public Codec {
 	public:
-		VpxEncoder(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
+		static const std::vector<CodecOption> & Options() {
+			static const std::vector<CodecOption> options = {
+				CodecOption::Integer("GOP",           &CodecConfig::gop,          1, 3600,   25,   false, "keyframe interval"),
+				CodecOption::Boolean("INTRA_REFRESH", &CodecConfig::intraRefresh,                 false, false, "cyclic background refresh instead of keyframes, GOP is unused"),
+				CodecOption::Integer("CBR",           &CodecConfig::cbr,          1, 100000, -1,   true,  "constant bitrate in kbps"),
+				CodecOption::Integer("VBR",           &CodecConfig::vbr,          1, 100000, 1000, true,  "variable bitrate in kbps, unused with CBR"),
+				CodecOption::Boolean("ROI",           &CodecConfig::roi,                          false, false, "apply quantizer offsets of the regions of interest"),
+			};
+			return options;
+		}
+
+		VpxEncoder(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose) 
 			: Codec(informat, width, height)
-            , m_frame_cnt(0) {
+            , m_frame_cnt(0), m_format(outformat), m_roiActive(false), m_valid(false) {
 
 
 			if(!vpx_img_alloc(&m_input, VPX_IMG_FMT_I420, width, height, 1))
@@ -34,7 +45,7 @@ class VpxEncoder : public Codec {
 			}
 
 			const vpx_codec_iface_t* algo = getAlgo(outformat);
-			vpx_codec_enc_cfg_t  cfg;
+			vpx_codec_enc_cfg_t& cfg = m_cfg;
 			if (vpx_codec_enc_config_default(algo, &cfg, 0) != VPX_CODEC_OK)
 			{
 				LOG(WARN) << "vpx_codec_enc_config_default"; 
@@ -43,30 +54,53 @@ class VpxEncoder : public Codec {
 			cfg.g_w = width;
 			cfg.g_h = height;	
 
-			std::map<std::string,std::string>::const_iterator keyint = opt.find("GOP");
-			if (keyint != opt.end()) {
-				int value = std::stoi(keyint->second);	
-				cfg.kf_min_dist = value;
-				cfg.kf_max_dist = value;						
+			if (config.gop > 0) {
+				cfg.kf_min_dist = config.gop;
+				cfg.kf_max_dist = config.gop;
 			}
 
-			std::map<std::string,std::string>::const_iterator cbr = opt.find("CBR");
-			if (cbr != opt.end()) {
-                cfg.rc_end_usage = VPX_CBR;
-                cfg.rc_target_bitrate = std::stoi(cbr->second);
-            }            
-			std::map<std::string,std::string>::const_iterator vbr = opt.find("VBR");
-			if (cbr != opt.end()) {
-                cfg.rc_end_usage = VPX_VBR;
-                cfg.rc_target_bitrate = std::stoi(vbr->second);
-            }   			
+			// libvpx has no scene change threshold, SCENECUT is not an option of this encoder
+
+			// the refresh replaces the periodic keyframes, only the first and the forced ones remain
+			// VP8 only runs its cyclic background refresh in error resilient mode
+			bool intraRefresh = config.intraRefresh;
+			if (intraRefresh) {
+				cfg.kf_mode = VPX_KF_DISABLED;
+			}
+			if (intraRefresh && (outformat == V4L2_PIX_FMT_VP8)) {
+				cfg.g_error_resilient = 1;
+			}
+
+			this->setRateControl(cfg, config);
 			
 			if(vpx_codec_enc_init(&m_codec, algo, &cfg, 0))    
 			{
 				LOG(WARN) << "vpx_codec_enc_init"; 
 			}
+			else
+			{
+				m_valid = true;
+				if (intraRefresh && (outformat == V4L2_PIX_FMT_VP9))
+				{
+					// aq-mode 3 is cyclic refresh
+					vpx_codec_control(&m_codec, VP9E_SET_AQ_MODE, 3);
+				}
+			}
 		}
 
+		bool isValid() { return m_valid; }
+
+        // CBR takes precedence over the default VBR
+        void setRateControl(vpx_codec_enc_cfg_t & cfg, const CodecConfig & config) {
+            if (config.cbr > 0) {
+                cfg.rc_end_usage = VPX_CBR;
+                cfg.rc_target_bitrate = config.cbr;
+            } else if (config.vbr > 0) {
+                cfg.rc_end_usage = VPX_VBR;
+                cfg.rc_target_bitrate = config.vbr;
+            }
+        }
+
         const vpx_codec_iface_t* getAlgo(int format)
         {
             const vpx_codec_iface_t* algo = NULL;
@@ -78,7 +112,7 @@ class VpxEncoder : public Codec {
             return algo;
         }        
 
-		void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) {
+		void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
 
                 libyuv::ConvertToI420((const uint8_t*)buffer, rsize,
                     m_input.planes[0], m_width,
@@ -89,7 +123,23 @@ class VpxEncoder : public Codec {
                     m_width, m_height,
                     libyuv::kRotate0, m_informat);
 
+                this->encode(sink);
+		}
+
+        bool getInputFrame(I420Frame & frame) {
+                frame = I420Frame(m_input.planes[0], m_input.planes[1], m_input.planes[2], m_width, m_height);
+                return true;
+        }
+
+        void encode(Sink* sink) {
+                this->setRoi();
+
                 int flags=0;          
+                if (m_forceKeyFrame) {
+                    flags |= VPX_EFLAG_FORCE_KF;
+                    m_forceKeyFrame = false;
+                    LOG(NOTICE) << "force keyframe";
+                }
                 if(vpx_codec_encode(&m_codec, &m_input, m_frame_cnt++ , 1, flags, VPX_DL_REALTIME))    
                 {					
                     LOG(WARN) << "vpx_codec_encode: " << vpx_codec_error(&m_codec) << "(" << vpx_codec_error_detail(&m_codec) << ")";
@@ -101,8 +151,9 @@ class VpxEncoder : public Codec {
                 {
                     if (pkt->kind==VPX_CODEC_CX_FRAME_PKT)
                     {
-                        int wsize = videoOutput->write((char*)pkt->data.frame.buf, pkt->data.frame.sz);
-                        LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
+                        FrameInfo info(pkt->data.frame.flags & VPX_FRAME_IS_KEY);
+                        int wsize = sink->write((char*)pkt->data.frame.buf, pkt->data.frame.sz, info);
+                        LOG(DEBUG) << "Copied size:" << wsize; 
                     }
                     else
                     {
@@ -111,17 +162,69 @@ class VpxEncoder : public Codec {
                 }
 		}			
 						
+        // segments of 16x16 macroblocks, VP8 has 4 segments and VP9 8, delta_q is on the 0..63 quantizer scale of both
+        void setRoi() {
+            if (!m_hasRoi && !m_roiActive) {
+                return;
+            }
+            vpx_roi_map_t roi;
+            memset(&roi, 0, sizeof(roi));
+            roi.rows = (m_height + 15) / 16;
+            roi.cols = (m_width + 15) / 16;
+            std::vector<uint8_t> map;
+            if (m_hasRoi) {
+                std::vector<int> offsets;
+                m_roi.segments(16, (m_format == V4L2_PIX_FMT_VP8) ? 4 : 8, map, offsets);
+                for (size_t i = 0; i < offsets.size(); ++i) {
+                    roi.delta_q[i] = std::max(-63, std::min(63, offsets[i]));
+                }
+                roi.roi_map = map.data();
+                m_hasRoi = false;
+            }
+            // a null map disables the segmentation
+            m_roiActive = (roi.roi_map != NULL);
+            vpx_codec_err_t err = (m_format == V4L2_PIX_FMT_VP8) ? vpx_codec_control(&m_codec, VP8E_SET_ROI_MAP, &roi) : vpx_codec_control(&m_codec, VP9E_SET_ROI_MAP, &roi);
+            if (err != VPX_CODEC_OK) {
+                LOG(WARN) << "vpx roi map: " << vpx_codec_error(&m_codec);
+            }
+        }
+
+	protected:
+		// libvpx takes a new target bitrate between frames, a VBR bitrate is unused while CBR is configured
+		bool reconfigure(const CodecConfig & config) {
+            if ( (config.cbr > 0) && (config.vbr != m_config.vbr) ) {
+                LOG(WARN) << "VBR cannot change the bitrate in CBR mode, change CBR";
+                return false;
+            }
+            vpx_codec_enc_cfg_t cfg = m_cfg;
+            this->setRateControl(cfg, config);
+            if (vpx_codec_enc_config_set(&m_codec, &cfg) != VPX_CODEC_OK) {
+                LOG(WARN) << "vpx_codec_enc_config_set: " << vpx_codec_error(&m_codec);
+                return false;
+            }
+            m_cfg = cfg;
+            return true;
+		}
+
+	public:
 		~VpxEncoder() {
+            if (m_valid) {
+                vpx_codec_destroy(&m_codec);
+            }
             vpx_img_free(&m_input);
 		}				
 
 	private:
 		vpx_codec_ctx_t m_codec;
+        vpx_codec_enc_cfg_t m_cfg;
         vpx_image_t     m_input;
         int             m_frame_cnt;
+        int             m_format;
+        bool            m_roiActive;
+        bool            m_valid;
 
 	public:
 		static const bool registration;        
 };
 
-const bool VpxEncoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_VP8, CodecCreator<VpxEncoder>::Create) && CodecFactory::get().registerEncoder(V4L2_PIX_FMT_VP9, CodecCreator<VpxEncoder>::Create);
\ No newline at end of file
+const bool VpxEncoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_VP8, CodecCreator<VpxEncoder>::Create, CodecCreator<VpxEncoder>::Options, "libvpx", 50) && CodecFactory::get().registerEncoder(V4L2_PIX_FMT_VP9, CodecCreator<VpxEncoder>::Create, CodecCreator<VpxEncoder>::Options, "libvpx", 50);
\ No newline at end of file
@@ -11,12 +11,12 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "libyuv.h"
 #include "logger.h"
 #include "codecfactory.h"
 
-class V4l2Output;
 extern "C" 
 {
 	#include "x264.h"
@@ -24,7 +24,19 @@ extern "C"
 
 class X264Encoder : public Codec {
 	public:
-		X264Encoder(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
+		static const std::vector<CodecOption> & Options() {
+			static const std::vector<CodecOption> options = {
+				CodecOption::Integer("GOP",           &CodecConfig::gop,          1, 3600, 25, false, "keyframe interval"),
+				CodecOption::Boolean("INTRA_REFRESH", &CodecConfig::intraRefresh,             false, false, "periodic intra refresh instead of IDR frames"),
+				CodecOption::Integer("SCENECUT",      &CodecConfig::scenecut,     0, 100,  -1, false, "scene change threshold, GOP is then the maximum interval"),
+				CodecOption::Integer("RC_CQP",        &CodecConfig::cqp,          0, 51,   -1, false, "constant quantizer"),
+				CodecOption::Integer("RC_CRF",        &CodecConfig::crf,          0, 51,   -1, true,  "constant rate factor"),
+				CodecOption::Boolean("ROI",           &CodecConfig::roi,                      false, false, "apply quantizer offsets of the regions of interest"),
+			};
+			return options;
+		}
+
+		X264Encoder(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose) 
 			: Codec(informat, width, height)
 			, m_encoder(NULL) {
 
@@ -40,33 +52,44 @@ class X264Encoder : public Codec {
 			param.i_bframe = 0;
 			param.b_repeat_headers = 1;
 
-			std::map<std::string,std::string>::const_iterator keyint = opt.find("GOP");
-			if (keyint != opt.end()) {
-				int value = std::stoi(keyint->second);	
-				param.i_keyint_min = value;
-				param.i_keyint_max = value;						
+			if (config.gop > 0) {
+				param.i_keyint_min = config.gop;
+				param.i_keyint_max = config.gop;
+			}
+
+			// spread intra macroblocks over the GOP instead of sending IDR frames
+			param.b_intra_refresh = config.intraRefresh;
+
+			// insert keyframes on scene changes, GOP is then the maximum interval
+			if (config.scenecut >= 0) {
+				param.i_scenecut_threshold = config.scenecut;
+				param.i_keyint_min = X264_KEYINT_MIN_AUTO;
 			}
 
-			std::map<std::string,std::string>::const_iterator rc_qcp = opt.find("RC_CQP");
-			if (rc_qcp != opt.end()) {
-				int rc_value = std::stoi(rc_qcp->second);
+			if (config.cqp >= 0) {
 				param.rc.i_rc_method = X264_RC_CQP;
-				param.rc.i_qp_constant = rc_value;
-				param.rc.i_qp_min = rc_value; 
-				param.rc.i_qp_max = rc_value;
+				param.rc.i_qp_constant = config.cqp;
+				param.rc.i_qp_min = config.cqp;
+				param.rc.i_qp_max = config.cqp;
 			}
-			std::map<std::string,std::string>::const_iterator rc_crf = opt.find("RC_CRF");
-			if (rc_crf != opt.end()) {	
-				int rc_value = std::stoi(rc_crf->second);		
+			if (config.crf >= 0) {
 				param.rc.i_rc_method = X264_RC_CRF;
-				param.rc.f_rf_constant = rc_value;
-				param.rc.f_rf_constant_max = rc_value;
+				param.rc.f_rf_constant = config.crf;
+				param.rc.f_rf_constant_max = config.crf;
 			}
 
 
+			// quant_offsets are only applied with adaptive quantization, a null strength keeps the preset behaviour
+			if (config.roi && (param.rc.i_aq_mode == X264_AQ_NONE)) {
+				param.rc.i_aq_mode = X264_AQ_VARIANCE;
+				param.rc.f_aq_strength = 0;
+			}
+
 			LOG(NOTICE) << "rc_method:" << param.rc.i_rc_method; 
 			LOG(NOTICE) << "i_qp_constant:" << param.rc.i_qp_constant; 
 			LOG(NOTICE) << "f_rf_constant:" << param.rc.f_rf_constant; 
+			LOG(NOTICE) << "b_intra_refresh:" << param.b_intra_refresh; 
+			LOG(NOTICE) << "i_scenecut_threshold:" << param.i_scenecut_threshold; 
 			
 			x264_picture_init( &m_pic_in );
 			x264_picture_alloc(&m_pic_in, X264_CSP_I420, width, height);
@@ -78,7 +101,9 @@ class X264Encoder : public Codec {
 			}			
 		}
 
-		void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) {
+		bool isValid() { return m_encoder != NULL; }
+
+		void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
 
 				libyuv::ConvertToI420((const uint8_t*)buffer, rsize,
 						m_pic_in.img.plane[0], m_width,
@@ -89,10 +114,56 @@ class X264Encoder : public Codec {
 						m_width, m_height,
 						libyuv::kRotate0, m_informat);
 
+				this->encode(sink);
+		}
+
+		bool getInputFrame(I420Frame & frame) {
+				frame = I420Frame(m_pic_in.img.plane[0], m_pic_in.img.plane[1], m_pic_in.img.plane[2], m_width, m_height);
+				return true;
+		}
+
+		void encode(Sink* sink) {
+					// b_repeat_headers makes x264 emit SPS/PPS in front of the IDR
+					m_pic_in.i_type = X264_TYPE_AUTO;
+					if (m_forceKeyFrame) {
+						m_pic_in.i_type = X264_TYPE_IDR;
+						m_forceKeyFrame = false;
+						LOG(NOTICE) << "force IDR";
+					}
+
+					// x264 keeps the SEI until the frame leaves the lookahead and releases it with sei_free, reset each frame to not free it twice
+					m_pic_in.extra_sei.num_payloads = 0;
+					m_pic_in.extra_sei.payloads = NULL;
+					m_pic_in.extra_sei.sei_free = NULL;
+					if (m_hasStamp) {
+						x264_sei_payload_t* payload = (x264_sei_payload_t*)malloc(sizeof(x264_sei_payload_t));
+						payload->payload_size = FrameStamp::payloadSize;
+						payload->payload_type = 5; // user_data_unregistered
+						payload->payload = (uint8_t*)malloc(FrameStamp::payloadSize);
+						m_stamp.serialize(payload->payload);
+						m_pic_in.extra_sei.num_payloads = 1;
+						m_pic_in.extra_sei.payloads = payload;
+						m_pic_in.extra_sei.sei_free = free;
+						m_hasStamp = false;
+					}
+
+					// one offset per macroblock, released by x264 with quant_offsets_free
+					m_pic_in.prop.quant_offsets = NULL;
+					m_pic_in.prop.quant_offsets_free = NULL;
+					if (m_hasRoi) {
+						std::vector<float> offsets = m_roi.offsets(16);
+						float* quant_offsets = (float*)malloc(offsets.size()*sizeof(float));
+						memcpy(quant_offsets, offsets.data(), offsets.size()*sizeof(float));
+						m_pic_in.prop.quant_offsets = quant_offsets;
+						m_pic_in.prop.quant_offsets_free = free;
+						m_hasRoi = false;
+					}
+
 					x264_nal_t* nals = NULL;
 					int i_nals = 0;
 					x264_encoder_encode(m_encoder, &nals, &i_nals, &m_pic_in, &m_pic_out);
 										
+					FrameInfo info(m_pic_out.b_keyframe);
 					if (i_nals > 1) {
 						int size = 0;
 						for (int i=0; i < i_nals; ++i) {
@@ -105,15 +176,30 @@ class X264Encoder : public Codec {
 							ptr+=nals[i].i_payload;
 						}
 						
-						int wsize = videoOutput->write(buffer,size);
+						int wsize = sink->write(buffer, size, info);
 						LOG(DEBUG) << "Copied nbnal:" << i_nals << " size:" << wsize; 					
 						
 					} else if (i_nals == 1) {
-						int wsize = videoOutput->write((char*)nals[0].p_payload, nals[0].i_payload);
+						int wsize = sink->write((char*)nals[0].p_payload, nals[0].i_payload, info);
 						LOG(DEBUG) << "Copied size:" << wsize; 					
 					}				
 		}			
 						
+	protected:
+		// x264 changes the rate factor between frames
+		bool reconfigure(const CodecConfig & config) {
+				x264_param_t param;
+				x264_encoder_parameters(m_encoder, &param);
+				if (param.rc.i_rc_method != X264_RC_CRF) {
+					LOG(WARN) << "RC_CRF can only be changed in CRF mode";
+					return false;
+				}
+				param.rc.f_rf_constant = config.crf;
+				param.rc.f_rf_constant_max = config.crf;
+				return x264_encoder_reconfig(m_encoder, &param) == 0;
+		}
+
+	public:
 		~X264Encoder() {
 				x264_picture_clean(&m_pic_in);
 				x264_encoder_close(m_encoder);
@@ -128,4 +214,4 @@ class X264Encoder : public Codec {
 		static const bool registration;
 };
 
-const bool X264Encoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_H264, CodecCreator<X264Encoder>::Create);
+const bool X264Encoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_H264, CodecCreator<X264Encoder>::Create, CodecCreator<X264Encoder>::Options, "x264", 50);
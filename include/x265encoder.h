@@ -11,12 +11,12 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "libyuv.h"
 #include "logger.h"
 #include "codecfactory.h"
 
-class V4l2Output;
 extern "C" 
 {
 	#include "x265.h"
@@ -24,7 +24,19 @@ extern "C"
 
 class X265Encoder : public Codec {
 	public:
-		X265Encoder(int outformat, int informat, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
+		static const std::vector<CodecOption> & Options() {
+			static const std::vector<CodecOption> options = {
+				CodecOption::Integer("GOP",           &CodecConfig::gop,          1, 3600, 25, false, "keyframe interval"),
+				CodecOption::Boolean("INTRA_REFRESH", &CodecConfig::intraRefresh,             false, false, "periodic intra refresh instead of IDR frames"),
+				CodecOption::Integer("SCENECUT",      &CodecConfig::scenecut,     0, 100,  -1, false, "scene change threshold, GOP is then the maximum interval"),
+				CodecOption::Integer("RC_CQP",        &CodecConfig::cqp,          0, 51,   -1, false, "constant quantizer"),
+				CodecOption::Integer("RC_CRF",        &CodecConfig::crf,          0, 51,   -1, false, "constant rate factor"),
+				CodecOption::Boolean("ROI",           &CodecConfig::roi,                      false, false, "apply quantizer offsets of the regions of interest"),
+			};
+			return options;
+		}
+
+		X265Encoder(int outformat, int informat, int width, int height, const CodecConfig & config, int verbose) 
             : Codec(informat, width, height)
 			, m_encoder(NULL), m_pic_in(NULL), m_pic_out(NULL), m_buff(NULL) {
 
@@ -42,28 +54,38 @@ class X265Encoder : public Codec {
 			param.fpsNum = 1;
 			param.fpsDenom = 1;
 
-			std::map<std::string,std::string>::const_iterator keyint = opt.find("GOP");
-			if (keyint != opt.end()) {
-				int value = std::stoi(keyint->second);	
-				param.keyframeMin = value;
-				param.keyframeMax = value;						
-				param.fpsDenom = value;
-			}			
-
-			std::map<std::string,std::string>::const_iterator rc_qcp = opt.find("RC_CQP");
-			if (rc_qcp != opt.end()) {
-				int rc_value = std::stoi(rc_qcp->second);
+			if (config.gop > 0) {
+				param.keyframeMin = config.gop;
+				param.keyframeMax = config.gop;
+				param.fpsDenom = config.gop;
+			}
+
+			// spread intra blocks over the GOP instead of sending IDR frames
+			param.bIntraRefresh = config.intraRefresh;
+
+			// insert keyframes on scene changes, GOP is then the maximum interval
+			if (config.scenecut >= 0) {
+				param.scenecutThreshold = config.scenecut;
+				param.keyframeMin = 0;
+			}
+
+			if (config.cqp >= 0) {
 				param.rc.rateControlMode = X265_RC_CQP;
-				param.rc.qp = rc_value;
-			}			
-			std::map<std::string,std::string>::const_iterator rc_crf = opt.find("RC_CRF");
-			if (rc_crf != opt.end()) {	
-				int rc_value = std::stoi(rc_crf->second);		
+				param.rc.qp = config.cqp;
+			}
+			if (config.crf >= 0) {
 				param.rc.rateControlMode = X265_RC_CRF;
-				param.rc.rfConstantMin = rc_value;
-				param.rc.rfConstantMax = rc_value;
+				param.rc.rfConstantMin = config.crf;
+				param.rc.rfConstantMax = config.crf;
 			}
 			
+			// quantOffsets are only applied with adaptive quantization, a null strength keeps the preset behaviour
+			if (config.roi && (param.rc.aqMode == X265_AQ_NONE)) {
+				param.rc.aqMode = X265_AQ_VARIANCE;
+				param.rc.aqStrength = 0;
+			}
+			m_roiBlockSize = (param.rc.qgSize == 8) ? 8 : 16;
+
             m_pic_in = x265_picture_alloc();
             x265_picture_init(&param, m_pic_in);
             m_buff= new char[width*height*3/2];
@@ -80,7 +102,9 @@ class X265Encoder : public Codec {
 			}
 		}
 
-		void convertAndWrite(const char* buffer, unsigned int rsize, V4l2Output* videoOutput) {
+		bool isValid() { return m_encoder != NULL; }
+
+		void convertAndWrite(const char* buffer, unsigned int rsize, Sink* sink) {
 
 				libyuv::ConvertToI420((const uint8_t*)buffer, rsize,
 							(uint8_t*)m_pic_in->planes[0], m_width,
@@ -91,9 +115,49 @@ class X265Encoder : public Codec {
 							m_width, m_height,
 							libyuv::kRotate0, m_informat);
 
+				this->encode(sink);
+		}
+
+		bool getInputFrame(I420Frame & frame) {
+				frame = I420Frame((uint8_t*)m_pic_in->planes[0], (uint8_t*)m_pic_in->planes[1], (uint8_t*)m_pic_in->planes[2], m_width, m_height);
+				return true;
+		}
+
+		void encode(Sink* sink) {
+					// bRepeatHeaders makes x265 emit VPS/SPS/PPS in front of the IDR
+					m_pic_in->sliceType = X265_TYPE_AUTO;
+					if (m_forceKeyFrame) {
+						m_pic_in->sliceType = X265_TYPE_IDR;
+						m_forceKeyFrame = false;
+						LOG(NOTICE) << "force IDR";
+					}
+
+					// x265 copies the user SEI when the picture is queued
+					x265_sei_payload payload;
+					uint8_t data[FrameStamp::payloadSize];
+					m_pic_in->userSEI.numPayloads = 0;
+					if (m_hasStamp) {
+						m_stamp.serialize(data);
+						payload.payloadSize = sizeof(data);
+						payload.payloadType = USER_DATA_UNREGISTERED;
+						payload.payload = data;
+						m_pic_in->userSEI.numPayloads = 1;
+						m_pic_in->userSEI.payloads = &payload;
+						m_hasStamp = false;
+					}
+
+					// x265 copies the offsets when the picture is queued
+					m_pic_in->quantOffsets = NULL;
+					if (m_hasRoi) {
+						m_quantOffsets = m_roi.offsets(m_roiBlockSize);
+						m_pic_in->quantOffsets = m_quantOffsets.data();
+						m_hasRoi = false;
+					}
+
 					x265_nal* nals = NULL;
 					uint32_t i_nals = 0;
                     if (x265_encoder_encode(m_encoder, &nals, &i_nals, m_pic_in, m_pic_out) > 0) {
+                        FrameInfo info(IS_X265_TYPE_I(m_pic_out->sliceType));
                         if (i_nals > 1) {
                             int size = 0;
                             for (int i=0; i < i_nals; ++i) {
@@ -106,11 +170,11 @@ class X265Encoder : public Codec {
                                 ptr+=nals[i].sizeBytes;
                             }
                             
-                            int wsize = videoOutput->write(buffer,size);
+                            int wsize = sink->write(buffer, size, info);
                             LOG(DEBUG) << "Copied nbnal:" << i_nals << " size:" << wsize; 					
                             
                         } else if (i_nals == 1) {
-                            int wsize = videoOutput->write((char*)nals[0].payload, nals[0].sizeBytes);
+                            int wsize = sink->write((char*)nals[0].payload, nals[0].sizeBytes, info);
                             LOG(DEBUG) << "Copied size:" << wsize; 					
                         }				
                     } else {
@@ -130,10 +194,12 @@ class X265Encoder : public Codec {
 		x265_picture* m_pic_in;
 		x265_picture* m_pic_out;
         char* m_buff;
+        int m_roiBlockSize;
+        std::vector<float> m_quantOffsets;
 
 	public:
 		static const bool registration;
 };
 
-const bool X265Encoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_HEVC, CodecCreator<X265Encoder>::Create);
+const bool X265Encoder::registration = CodecFactory::get().registerEncoder(V4L2_PIX_FMT_HEVC, CodecCreator<X265Encoder>::Create, CodecCreator<X265Encoder>::Options, "x265", 50);
 
@@ -15,7 +15,7 @@
 class YuvConverter : public Codec
 {
 public:
-        YuvConverter(int outformat, int informat, int width, int height, const std::map<std::string, std::string> &opt, int verbose)
+        YuvConverter(int outformat, int informat, int width, int height, const CodecConfig &config, int verbose)
             : Codec(informat, width, height), m_outformat(outformat)
         {
                 m_i420 = new uint8_t[width * height * 2];
@@ -26,7 +26,7 @@ public:
                 delete[] m_i420;
         }
 
-        void convertAndWrite(const char *buffer, unsigned int rsize, V4l2Output *videoOutput)
+        void convertAndWrite(const char *buffer, unsigned int rsize, Sink *sink)
         {
                 uint8_t *i420_p0 = m_i420;
                 uint8_t *i420_p1 = i420_p0 + m_width * m_height;
@@ -41,7 +41,7 @@ public:
                                       m_width, m_height,
                                       libyuv::kRotate0, m_informat);
 
-                char outBuffer[videoOutput->getBufferSize()];
+                char outBuffer[sink->getBufferSize()];
                 libyuv::ConvertFromI420(i420_p0, m_width,
                                         i420_p1, (m_width + 1) / 2,
                                         i420_p2, (m_width + 1) / 2,
@@ -49,7 +49,7 @@ public:
                                         m_width, m_height,
                                         m_outformat);
 
-                int wsize = videoOutput->write(outBuffer, sizeof(outBuffer));
+                int wsize = sink->write(outBuffer, sizeof(outBuffer), FrameInfo(true));
                 LOG(DEBUG) << "Copied " << rsize << " " << wsize;
         }
 
@@ -61,4 +61,4 @@ public:
         static const bool registration;
 };
 
-const bool YuvConverter::registration = CodecFactory::get().registerEncoder(0, CodecCreator<YuvConverter>::Create);
+const bool YuvConverter::registration = CodecFactory::get().registerEncoder(0, CodecCreator<YuvConverter>::Create, CodecCreator<YuvConverter>::Options, "libyuv", 50);
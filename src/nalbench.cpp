@@ -0,0 +1,137 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** nalbench.cpp
+**
+** Compare NAL splitting throughput of h264bitstream find_nal_unit and nalscanner
+**
+** -------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <random>
+#include <chrono>
+
+#include "h264_stream.h"
+#include "nalscanner.h"
+
+// random payload with emulation prevention, NAL units of about nalSize bytes
+std::vector<uint8_t> generateStream(size_t size, size_t nalSize) {
+	std::vector<uint8_t> stream;
+	stream.reserve(size + nalSize);
+	std::mt19937 rng(0);
+	while (stream.size() < size) {
+		const uint8_t startcode[] = { 0, 0, 0, 1, 0x41 };
+		stream.insert(stream.end(), startcode, startcode + sizeof(startcode));
+		int zeros = 0;
+		for (size_t i = 0; i < nalSize; ++i) {
+			// skewed toward small values like entropy coded data
+			uint8_t value = (rng() % 4) ? rng() : 0;
+			if ( (zeros >= 2) && (value <= 3) ) {
+				stream.push_back(3);
+				zeros = 0;
+			}
+			stream.push_back(value);
+			zeros = value ? 0 : zeros+1;
+		}
+		stream.push_back(0x80);
+	}
+	return stream;
+}
+
+template<typename F>
+void bench(const char* name, std::vector<uint8_t> & stream, int loops, F split) {
+	auto start = std::chrono::steady_clock::now();
+	size_t count = 0;
+	for (int i = 0; i < loops; ++i) {
+		count += split(stream.data(), stream.size());
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << name << "\t nal:" << count/loops << "\t " << (stream.size()*loops/elapsed.count()/1e6) << " MB/s" << std::endl;
+}
+
+/* ---------------------------------------------------------------------------
+**  main
+** -------------------------------------------------------------------------*/
+int main(int argc, char* argv[])
+{
+	size_t size = 64*1024*1024;
+	size_t nalSize = 8*1024;
+	int loops = 5;
+	int c = 0;
+	while ((c = getopt (argc, argv, "hs:n:l:")) != -1)
+	{
+		switch (c)
+		{
+			case 's':	size = atol(optarg); break;
+			case 'n':	nalSize = atol(optarg); break;
+			case 'l':	loops = atoi(optarg); break;
+			case 'h':
+			{
+				std::cout << argv[0] << " [-s size] [-n nalsize] [-l loops] [file]" << std::endl;
+				std::cout << "\t -s size       : size of the generated stream (default "<< size << ")" << std::endl;
+				std::cout << "\t -n nalsize    : size of the generated NAL units (default "<< nalSize << ")" << std::endl;
+				std::cout << "\t -l loops      : number of iterations (default "<< loops << ")" << std::endl;
+				std::cout << "\t file          : Annex-B file to use instead of a generated stream" << std::endl;
+				exit(0);
+			}
+		}
+	}
+
+	std::vector<uint8_t> stream;
+	if (optind<argc)
+	{
+		std::ifstream file(argv[optind], std::ios::binary);
+		stream.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+	else
+	{
+		stream = generateStream(size, nalSize);
+	}
+
+	bench("find_nal_unit", stream, loops, [](uint8_t* buffer, size_t size) {
+		size_t count = 0;
+		int nal_start = 0, nal_end = 0;
+		uint8_t* p = buffer;
+		int rsize = size;
+		// 0 when no start code is left, -1 for the last NAL that ends with the buffer
+		int ret = 0;
+		while ((ret = find_nal_unit(p, rsize, &nal_start, &nal_end)) != 0) {
+			count++;
+			if (ret < 0) {
+				break;
+			}
+			p += nal_end;
+			rsize -= nal_end;
+		}
+		return count;
+	});
+
+	bench("scalar", stream, loops, [](uint8_t* buffer, size_t size) {
+		size_t count = 0;
+		const uint8_t* end = buffer + size;
+		for (const uint8_t* p = findStartCodeScalar(buffer, end); p < end; p = findStartCodeScalar(p+3, end)) {
+			count++;
+		}
+		return count;
+	});
+
+	bench("nalscanner", stream, loops, [](uint8_t* buffer, size_t size) {
+		size_t count = 0;
+		NalSplitter splitter(buffer, size);
+		NalUnit nal;
+		while (splitter.next(nal)) {
+			count++;
+		}
+		return count;
+	});
+
+	return 0;
+}
@@ -18,13 +18,17 @@
 
 #include <iostream>
 #include <map>
+#include <list>
+#include <algorithm>
 
 #include "logger.h"
+#include "libyuv.h"
 
 #include "V4l2Access.h"
 #include "V4l2Capture.h"
 
 #include "codecfactory.h"
+#include "sinkfactory.h"
 
 #ifdef HAVE_X264   
 #include "x264encoder.h"
@@ -35,27 +39,160 @@
 #ifdef HAVE_VPX   
 #include "vpxencoder.h"
 #endif
+#ifdef HAVE_CUDA
+#include "cudaencoder.h"
+#endif
 #ifdef HAVE_JPEG  
 #include "jpegencoder.h"
 #include "jpegdecoder.h"
 #endif
 #include "yuvconverter.h"
 
+#include "v4l2sink.h"
+#include "filesink.h"
+#include "rtpsink.h"
+#include "shmsink.h"
+
+#include "roimap.h"
+#ifdef HAVE_OPENCV
+#include "objectdetector.h"
+#include "objecttracker.h"
+#endif
+
+// -----------------------------------------
+//    regions of interest of the frames
+// -----------------------------------------
+class RoiSource {
+	public:
+		RoiSource(const std::map<std::string,std::string>& roiopt, int informat, int width, int height)
+			: m_informat(informat), m_width(width), m_height(height), m_offset(-6), m_background(0), m_reader(NULL), m_frameIndex(0) {
+			std::map<std::string,std::string>::const_iterator it = roiopt.find("OFFSET");
+			if (it != roiopt.end()) {
+				m_offset = std::stoi(it->second);
+			}
+			it = roiopt.find("BACKGROUND");
+			if (it != roiopt.end()) {
+				m_background = std::stoi(it->second);
+			}
+			it = roiopt.find("METADATA");
+			if (it != roiopt.end()) {
+				m_reader = new RoiMetadataReader(it->second);
+			}
+#ifdef HAVE_OPENCV
+			m_detector = NULL;
+			m_tracker = NULL;
+			it = roiopt.find("CASCADE");
+			if (it != roiopt.end()) {
+				m_detector = new ObjectDetector(it->second, width, height);
+				m_tracker = new ObjectTracker(width, height, m_detector->getDetectWidth(), m_detector->getDetectHeight());
+			}
+#endif
+		}
+
+		~RoiSource() {
+			delete m_reader;
+#ifdef HAVE_OPENCV
+			delete m_tracker;
+			delete m_detector;
+#endif
+		}
+
+		// regions of a frame, sequence is its FrameStamp or -1
+		bool getRoiMap(const char* buffer, int rsize, long long sequence, RoiMap & roi) {
+			roi = RoiMap(m_width, m_height, m_background);
+			bool found = false;
+			RoiMetadataReader::Entry entry;
+			if (m_reader && m_reader->getObjects(sequence, entry)) {
+				// metadata may come from a frame of another size
+				int width = entry.width ? entry.width : m_width;
+				int height = entry.height ? entry.height : m_height;
+				for (const RoiMap::Region & r : entry.objects) {
+					roi.add(r.x * m_width / width, r.y * m_height / height, r.width * m_width / width, r.height * m_height / height, m_offset);
+				}
+				found = true;
+			}
+#ifdef HAVE_OPENCV
+			if (m_detector && m_detector->isValid()) {
+				const uint8_t* luma = this->getLuma(buffer, rsize);
+				m_detector->process(luma, m_width, m_frameIndex++);
+				std::vector<cv::Rect> objects;
+				std::vector<uint8_t> plane;
+				unsigned int detectedIndex = 0;
+				if (m_detector->getResult(objects, plane, detectedIndex)) {
+					m_tracker->reset(objects, plane.data());
+				}
+				for (const TrackedObject & obj : m_tracker->track(luma, m_width)) {
+					if (!obj.lost) {
+						roi.add(obj.rect.x, obj.rect.y, obj.rect.width, obj.rect.height, m_offset);
+					}
+				}
+				found = true;
+			}
+#endif
+			return found;
+		}
+
+	protected:
+#ifdef HAVE_OPENCV
+		// planar inputs start with the luma plane, others are converted
+		const uint8_t* getLuma(const char* buffer, int rsize) {
+			if ( (m_informat == V4L2_PIX_FMT_YUV420) || (m_informat == V4L2_PIX_FMT_NV12) || (m_informat == V4L2_PIX_FMT_GREY) ) {
+				return (const uint8_t*)buffer;
+			}
+			m_i420.resize(m_width*m_height*3/2);
+			libyuv::ConvertToI420((const uint8_t*)buffer, rsize,
+					m_i420.data(), m_width,
+					m_i420.data() + m_width*m_height, (m_width+1)/2,
+					m_i420.data() + m_width*m_height*5/4, (m_width+1)/2,
+					0, 0,
+					m_width, m_height,
+					m_width, m_height,
+					libyuv::kRotate0, m_informat);
+			return m_i420.data();
+		}
+#endif
+
+	protected:
+		int                  m_informat;
+		int                  m_width;
+		int                  m_height;
+		int                  m_offset;
+		int                  m_background;
+		RoiMetadataReader*   m_reader;
+		unsigned int         m_frameIndex;
+#ifdef HAVE_OPENCV
+		ObjectDetector*      m_detector;
+		ObjectTracker*       m_tracker;
+		std::vector<uint8_t> m_i420;
+#endif
+};
+
 // -----------------------------------------
 //    capture, convert, output 
 // -----------------------------------------
-int convert(V4l2Capture* videoCapture, const std::string& out_devname, V4l2IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, int & stop, int verbose=0) {
+int convert(V4l2Capture* videoCapture, const std::list<std::string>& outList, int outformat, const std::map<std::string,std::string>& opt, const std::map<std::string,std::string>& sinkopt, const std::map<std::string,std::string>& roiopt, int & stop, int & keyframe, int verbose=0) {
 	int ret = 0;
 
-	// init V4L2 output interface
+	// init outputs
 	int width = videoCapture->getWidth();
 	int height = videoCapture->getHeight();		
-	V4L2DeviceParameters outparam(out_devname.c_str(), outformat, width, height, 0, ioTypeOut, verbose);
-	V4l2Output* videoOutput = V4l2Output::create(outparam);
-	if (videoOutput == NULL)
+	SinkList* sinks = new SinkList(outformat, width, height);
+	for (const std::string & out : outList)
+	{
+		Sink* sink = SinkFactory::get().Create(out, outformat, width, height, sinkopt, verbose);
+		if (sink == NULL)
+		{
+			LOG(WARN) << "Cannot create output:" << out; 
+			ret = -1;
+		}
+		else
+		{
+			sinks->add(sink);
+		}
+	}
+	if (ret != 0)
 	{	
-		LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname; 
-		ret = -1;
+		delete sinks;
 	}
 	else
 	{		
@@ -64,14 +201,20 @@ int convert(V4l2Capture* videoCapture, const std::string& out_devname, V4l2IoTyp
 		if (!codec)
 		{
 			LOG(WARN) << "Cannot create encoder " << V4l2Device::fourcc(outformat); 
+			ret = -1;
 		}
 		else
 		{						
+			RoiSource* roiSource = roiopt.empty() ? NULL : new RoiSource(roiopt, informat, width, height);
+
 			timeval tv;
 			timeval refTime;
 			timeval curTime;
 
-			LOG(NOTICE) << "Start Compressing to " << out_devname;  					
+			for (const std::string & out : outList)
+			{
+				LOG(NOTICE) << "Start Compressing to " << out;  					
+			}
 			
 			while (!stop) 
 			{
@@ -89,7 +232,23 @@ int convert(V4l2Capture* videoCapture, const std::string& out_devname, V4l2IoTyp
 					timersub(&curTime,&refTime,&captureTime);
 					refTime = curTime;
 					
-					codec->convertAndWrite(buffer, rsize, videoOutput);
+					if (keyframe) {
+						keyframe = 0;
+						codec->forceKeyFrame();
+					}
+					// carry the stamp of the source into the bitstream
+					FrameStamp stamp;
+					bool stamped = (rsize > 0) && stamp.extract(informat, (const uint8_t*)buffer, rsize, width, height);
+					if (stamped) {
+						LOG(DEBUG) << "stamp sequence:" << stamp.sequence << " latency:" << (FrameStamp::now() - stamp.timestamp) << "us";
+						codec->setFrameStamp(stamp);
+					}
+					// metadata are matched by the FrameStamp sequence when the frames are stamped
+					RoiMap roi;
+					if ( roiSource && (rsize > 0) && roiSource->getRoiMap(buffer, rsize, stamped ? stamp.sequence : -1, roi) ) {
+						codec->setRoiMap(roi);
+					}
+					codec->convertAndWrite(buffer, rsize, sinks);
 
 					gettimeofday(&curTime, NULL);												
 					timeval endodeTime;
@@ -106,9 +265,10 @@ int convert(V4l2Capture* videoCapture, const std::string& out_devname, V4l2IoTyp
 				}
 			}
 			
+			delete roiSource;
 			delete codec;
 		}
-		delete videoOutput;
+		delete sinks;
 	}
 
 	return ret;
@@ -119,6 +279,11 @@ int convert(V4l2Capture* videoCapture, const std::string& out_devname, V4l2IoTyp
 ** -------------------------------------------------------------------------*/
 int stop=0;
 
+/* ---------------------------------------------------------------------------
+**  keyframe request
+** -------------------------------------------------------------------------*/
+int keyframe=0;
+
 /* ---------------------------------------------------------------------------
 **  SIGINT handler
 ** -------------------------------------------------------------------------*/
@@ -128,6 +293,14 @@ void sighandler(int)
        stop =1;
 }
 
+/* ---------------------------------------------------------------------------
+**  SIGUSR1 handler
+** -------------------------------------------------------------------------*/
+void keyframehandler(int)
+{ 
+       keyframe =1;
+}
+
 /* ---------------------------------------------------------------------------
 **  main
 ** -------------------------------------------------------------------------*/
@@ -135,22 +308,73 @@ int main(int argc, char* argv[])
 {	
 	int verbose=0;
 	const char *in_devname = "/dev/video0";	
-	const char *out_devname = "/dev/video1";	
+	std::list<std::string> outList;
 	int c = 0;
 	V4l2IoType ioTypeIn  = IOTYPE_MMAP;
-	V4l2IoType ioTypeOut = IOTYPE_MMAP;
 	std::map<std::string,std::string> opt;
-	opt["VBR"] = "1000";
+	std::map<std::string,std::string> sinkopt;
+	std::map<std::string,std::string> roiopt;
 	std::string strformat = "VP80";
-	opt["GOP"] = "25";
 	
-	while ((c = getopt (argc, argv, "hv::rw" "f:" "C:V:Q:F:G:q:d:")) != -1)
+	while ((c = getopt (argc, argv, "hv::rw" "f:e:o:" "C:V:Q:F:G:q:d:" "IS:" "T:M:" "R:D:O:B:")) != -1)
 	{
 		switch (c)
 		{
 			case 'v':	verbose = 1; if (optarg && *optarg=='v') verbose++;  break;
 			
 			case 'f':	strformat      = optarg; break;
+			case 'e':
+			{
+				// auto:fps gives the frame budget of the benchmark
+				std::string encoder(optarg);
+				size_t pos = encoder.find(':');
+				if (pos != std::string::npos) {
+					opt["FPS"] = encoder.substr(pos+1);
+					encoder.erase(pos);
+				}
+				opt["ENCODER"] = encoder;
+				break;
+			}
+
+			// any codec option as key=value, a key alone sets a boolean
+			case 'o':
+			{
+				std::string keyvalue(optarg);
+				if (keyvalue == "help") {
+					std::cout << "codec options:" << std::endl;
+					for (auto & it : CodecFactory::get().SupportedOption()) {
+						const CodecOption & option = it.second;
+						std::cout << "\t " << it.first << " " << option.name;
+						if (option.type == CodecOption::BOOLEAN) {
+							std::cout << " (boolean, default " << option.defaultValue << ")";
+						} else {
+							std::cout << " (" << option.min << ".." << option.max;
+							if (option.defaultValue >= 0) {
+								std::cout << ", default " << option.defaultValue;
+							}
+							std::cout << ")";
+						}
+						std::cout << (option.runtime ? " runtime" : "") << " : " << option.help << std::endl;
+					}
+					exit(0);
+				}
+				size_t pos = keyvalue.find('=');
+				std::string key = keyvalue.substr(0, pos);
+				std::transform(key.begin(), key.end(), key.begin(), ::toupper);
+				if (pos == std::string::npos) {
+					// a key alone is only a value for a boolean, unknown keys are reported with the codec options
+					bool integer = false;
+					for (auto & it : CodecFactory::get().SupportedOption()) {
+						integer = integer || ( (key == it.second.name) && (it.second.type != CodecOption::BOOLEAN) );
+					}
+					if (integer) {
+						std::cout << "Option " << key << " needs a value (-o " << key << "=value)" << std::endl;
+						exit(1);
+					}
+				}
+				opt[key] = (pos == std::string::npos) ? "1" : keyvalue.substr(pos+1);
+				break;
+			}
 
 			// parameters for VPx/H26x
 			case 'G':	opt["GOP"] = optarg; break;
@@ -158,31 +382,78 @@ int main(int argc, char* argv[])
 			case 'V':	opt["VBR"] = optarg; break;	
 			case 'Q':	opt["RC_CQP"] = optarg; break;	
 			case 'F':	opt["RC_CRF"] = optarg; break;				
+			case 'I':	opt["INTRA_REFRESH"] = "1"; break;				
+			case 'S':	opt["SCENECUT"] = optarg; break;				
 
 			// parameters for JPEG
 			case 'q':	opt["QUALITY"] = optarg; break;
 			case 'd':	opt["DRI"] = optarg; break;	
 			
+			// parameters for file outputs
+			case 'T':	sinkopt["SEGMENT_DURATION"] = optarg; break;
+			case 'M':
+			{
+				char* end = NULL;
+				unsigned long long size = strtoull(optarg, &end, 10);
+				if ( (*optarg == '\0') || (*optarg == '-') || (*end != '\0') || (size == 0) || (size > 1024*1024) ) {
+					std::cout << "Invalid segment size " << optarg << " : a number of MB in 1.." << 1024*1024 << std::endl;
+					exit(1);
+				}
+				sinkopt["SEGMENT_SIZE"] = std::to_string(size*1024*1024);
+				break;
+			}
+
+			// regions of interest
+			case 'R':	roiopt["METADATA"] = optarg; break;
+			case 'D':	roiopt["CASCADE"] = optarg; break;
+			case 'O':	roiopt["OFFSET"] = optarg; break;
+			case 'B':	roiopt["BACKGROUND"] = optarg; break;
+			
 			case 'r':	ioTypeIn  = IOTYPE_READWRITE; break;			
-			case 'w':	ioTypeOut = IOTYPE_READWRITE; break;	
+			case 'w':	sinkopt["IOTYPE"] = "READWRITE"; break;	
 			case 'h':
 			{
-				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
+				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device [dest_device ...]" << std::endl;
 				std::cout << "\t -v                   : verbose " << std::endl;
 				std::cout << "\t -vv                  : very verbose " << std::endl;
 
+				std::cout << "\t -o key=value         : codec option, -o help lists the options of each codec" << std::endl;
 				std::cout << "\t -C bitrate           : target CBR bitrate" << std::endl;
-				std::cout << "\t -V bitrate           : target VBR bitrate" << std::endl;
+				std::cout << "\t -V bitrate           : target VBR bitrate (default 1000)" << std::endl;
+				std::cout << "\t -G gop               : keyframe interval (default 25)" << std::endl;
+				std::cout << "\t -I                   : periodic intra refresh instead of keyframes" << std::endl;
+				std::cout << "\t -S threshold         : insert keyframes on scene changes (GOP becomes the maximum interval)" << std::endl;
 				std::cout << "\t -f format            : format (default is VP80) ( supported: ";
 				for (int format : CodecFactory::get().SupportedFormat()) {
 					std::cout << V4l2Device::fourcc(format) << " ";
 				}
 				std::cout << ")" << std::endl;
+				std::cout << "\t -e encoder           : encoder implementation, by default the first one ( ";
+				for (int format : CodecFactory::get().SupportedFormat()) {
+					std::list<std::string> encoders = CodecFactory::get().SupportedEncoder(format);
+					if (format && (encoders.size() > 1)) {
+						std::cout << V4l2Device::fourcc(format) << ":";
+						for (const std::string & name : encoders) {
+							std::cout << name << (name == encoders.back() ? " " : ",");
+						}
+					}
+				}
+				std::cout << ")" << std::endl;
+				std::cout << "\t -e auto[:fps]        : encoder benchmarked as the fastest in the frame budget (default 25 fps)" << std::endl;
 
+				std::cout << "\t -R metadata          : regions of interest from JSON lines written by v4l2detect_yuv -m (file or fifo)" << std::endl;
+#ifdef HAVE_OPENCV
+				std::cout << "\t -D cascade           : regions of interest detected with an OpenCV cascade classifier" << std::endl;
+#endif
+				std::cout << "\t -O offset            : quantizer offset of the regions of interest (default -6)" << std::endl;
+				std::cout << "\t -B offset            : quantizer offset outside the regions of interest (default 0)" << std::endl;
+				std::cout << "\t -T duration          : file output segment duration in seconds" << std::endl;
+				std::cout << "\t -M size              : file output segment size in MB" << std::endl;
 				std::cout << "\t -r                   : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w                   : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t source_device        : V4L2 capture device (default "<< in_devname << ")" << std::endl;
-				std::cout << "\t dest_device          : V4L2 capture device (default "<< out_devname << ")" << std::endl;
+				std::cout << "\t dest_device          : V4L2 output device (default /dev/video1) or file://path or rtp://host:port or shm://socket" << std::endl;
+				std::cout << "\t SIGUSR1              : force next frame to be a keyframe" << std::endl;
 				exit(0);
 			}
 		}
@@ -192,19 +463,49 @@ int main(int argc, char* argv[])
 		in_devname = argv[optind];
 		optind++;
 	}	
-	if (optind<argc)
+	while (optind<argc)
 	{
-		out_devname = argv[optind];
+		outList.push_back(argv[optind]);
 		optind++;
 	}
+	if (outList.empty())
+	{
+		outList.push_back("/dev/video1");
+	}
 
 	int outformat = V4l2Device::fourcc(strformat.c_str());
 		
 	signal(SIGINT,sighandler);	
+	signal(SIGUSR1,keyframehandler);	
 
 	// initialize log4cpp
 	initLogger(verbose);
 
+	// check the regions of interest options before opening the devices
+	for (const char* key : { "OFFSET", "BACKGROUND" }) {
+		auto it = roiopt.find(key);
+		if (it != roiopt.end()) {
+			char* end = NULL;
+			long offset = strtol(it->second.c_str(), &end, 10);
+			if ( it->second.empty() || (*end != '\0') || (offset < -51) || (offset > 51) ) {
+				LOG(ERROR) << "Invalid quantizer offset " << key << "=" << it->second << " : not an integer in -51..51";
+				return -1;
+			}
+		}
+	}
+#ifndef HAVE_OPENCV
+	if (roiopt.find("CASCADE") != roiopt.end()) {
+		LOG(ERROR) << "Detection of regions of interest (-D) needs a build with OpenCV";
+		return -1;
+	}
+#endif
+	if ( (roiopt.find("METADATA") != roiopt.end()) || (roiopt.find("CASCADE") != roiopt.end()) ) {
+		// encoders enable what quantizer offsets need
+		opt["ROI"] = "1";
+	} else {
+		roiopt.clear();
+	}
+
 	// init V4L2 capture interface
 	V4L2DeviceParameters param(in_devname,0,0,0,0,ioTypeIn,verbose);
 	V4l2Capture* videoCapture = V4l2Capture::create(param);
@@ -217,7 +518,7 @@ int main(int argc, char* argv[])
 	}
 	else
 	{
-		ret = convert(videoCapture, out_devname, ioTypeOut, outformat, opt, stop, verbose);
+		ret = convert(videoCapture, outList, outformat, opt, sinkopt, roiopt, stop, keyframe, verbose);
 		delete videoCapture;
 	}
 
@@ -5,7 +5,7 @@
 **
 ** v4l2copy.cpp
 ** 
-** Copy from a V4L2 capture device to an other V4L2 output device
+** Copy from a V4L2 capture device to other V4L2 output devices
 ** 
 ** -------------------------------------------------------------------------*/
 
@@ -18,6 +18,7 @@
 #include <signal.h>
 
 #include <fstream>
+#include <list>
 
 #include "logger.h"
 
@@ -25,6 +26,12 @@
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
 
+#include "sinkfactory.h"
+#include "v4l2sink.h"
+#include "filesink.h"
+#include "shmsink.h"
+#include "nalscanner.h"
+
 int stop=0;
 
 /* ---------------------------------------------------------------------------
@@ -36,6 +43,38 @@ void sighandler(int)
        stop =1;
 }
 
+/* ---------------------------------------------------------------------------
+**  keyframe flag of a captured frame, so that file segments start on a keyframe
+**  H264/HEVC frames need an IDR, VP8/VP9 the key frame type, other formats are intra only
+** -------------------------------------------------------------------------*/
+bool isKeyFrame(int format, const char* buffer, int size)
+{
+	const uint8_t* data = (const uint8_t*)buffer;
+	bool keyframe = true;
+	if ( (format == V4L2_PIX_FMT_H264) || (format == V4L2_PIX_FMT_HEVC) ) {
+		bool hevc = (format == V4L2_PIX_FMT_HEVC);
+		NalSplitter splitter(data, size, hevc);
+		NalUnit nal;
+		keyframe = false;
+		while (!keyframe && splitter.next(nal)) {
+			keyframe = hevc ? ( (nal.type == 19) || (nal.type == 20) ) : (nal.type == 5);
+		}
+	} else if (format == V4L2_PIX_FMT_VP8) {
+		// frame tag : frame_type is 0 for a key frame
+		keyframe = (size > 0) && ((data[0] & 0x01) == 0);
+	} else if (format == V4L2_PIX_FMT_VP9) {
+		// uncompressed header : frame_marker(2) profile(2) [reserved(1)] show_existing_frame(1) frame_type(1)
+		keyframe = false;
+		if (size > 0) {
+			int profile = ((data[0] >> 5) & 0x01) | ((data[0] >> 3) & 0x02);
+			int bit = (profile == 3) ? 5 : 4;
+			bool showExisting = (data[0] >> (7 - bit)) & 0x01;
+			keyframe = !showExisting && (((data[0] >> (6 - bit)) & 0x01) == 0);
+		}
+	}
+	return keyframe;
+}
+
 /* ---------------------------------------------------------------------------
 **  main
 ** -------------------------------------------------------------------------*/
@@ -43,10 +82,10 @@ int main(int argc, char* argv[])
 {	
 	int verbose=0;
 	const char *in_devname = "/dev/video0";	
-	const char *out_devname = "/dev/video1";	
+	std::list<std::string> outList;
 	int c = 0;
 	V4l2IoType ioTypeIn  = IOTYPE_MMAP;
-	V4l2IoType ioTypeOut = IOTYPE_MMAP;
+	std::map<std::string,std::string> sinkopt;
 	
 	while ((c = getopt (argc, argv, "hP:F:v::rw")) != -1)
 	{
@@ -54,16 +93,16 @@ int main(int argc, char* argv[])
 		{
 			case 'v':	verbose   = 1; if (optarg && *optarg=='v') verbose++;  break;
 			case 'r':	ioTypeIn  = IOTYPE_READWRITE; break;			
-			case 'w':	ioTypeOut = IOTYPE_READWRITE; break;			
+			case 'w':	sinkopt["IOTYPE"] = "READWRITE"; break;			
 			case 'h':
 			{
-				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
+				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device [dest_device ...]" << std::endl;
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
-				std::cout << "\t dest_device   : V4L2 capture device (default "<< out_devname << ")" << std::endl;
+				std::cout << "\t dest_device   : V4L2 output device (default /dev/video1), file://path or shm://socket" << std::endl;
 				exit(0);
 			}
 		}
@@ -73,11 +112,15 @@ int main(int argc, char* argv[])
 		in_devname = argv[optind];
 		optind++;
 	}	
-	if (optind<argc)
+	while (optind<argc)
 	{
-		out_devname = argv[optind];
+		outList.push_back(argv[optind]);
 		optind++;
-	}	
+	}
+	if (outList.empty())
+	{
+		outList.push_back("/dev/video1");
+	}
 
 	// initialize log4cpp
 	initLogger(verbose);
@@ -92,18 +135,35 @@ int main(int argc, char* argv[])
 	}
 	else
 	{
-		// init V4L2 output interface
-		V4L2DeviceParameters outparam(out_devname, videoCapture->getFormat(), videoCapture->getWidth(), videoCapture->getHeight(), 0, ioTypeOut, verbose);
-		V4l2Output* videoOutput = V4l2Output::create(outparam);
-		if (videoOutput == NULL)
+		// init outputs, each frame is read once and written to all of them
+		int format = videoCapture->getFormat();
+		int width = videoCapture->getWidth();
+		int height = videoCapture->getHeight();
+		SinkList* outputs = new SinkList(format, width, height);
+		for (const std::string & out : outList)
+		{
+			Sink* sink = SinkFactory::get().Create(out, format, width, height, sinkopt, verbose);
+			if (sink == NULL)
+			{	
+				LOG(WARN) << "Cannot create output:" << out; 
+			}
+			else
+			{
+				outputs->add(sink);
+			}
+		}
+		if (outputs->empty())
 		{	
-			LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname; 
+			LOG(WARN) << "No output available"; 
 		}
 		else
 		{		
 			timeval tv;
 			
-			LOG(NOTICE) << "Start Copying from " << in_devname << " to " << out_devname; 
+			for (const std::string & out : outList)
+			{
+				LOG(NOTICE) << "Start Copying from " << in_devname << " to " << out; 
+			}
 			signal(SIGINT,sighandler);				
 			while (!stop) 
 			{
@@ -121,7 +181,7 @@ int main(int argc, char* argv[])
 					}
 					else
 					{
-						int wsize = videoOutput->write(buffer, rsize);
+						int wsize = outputs->write(buffer, rsize, FrameInfo(isKeyFrame(videoCapture->getFormat(), buffer, rsize)));
 						LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
 					}
 				}
@@ -131,8 +191,8 @@ int main(int argc, char* argv[])
 					stop=1;
 				}
 			}
-			delete videoOutput;
 		}
+		delete outputs;
 		delete videoCapture;
 	}
 	
@@ -5,7 +5,9 @@
 **
 ** v4l2detect.cpp
 ** 
-** Copy from a V4L2 capture device to an other V4L2 output device
+** Copy from a V4L2 capture device to an other V4L2 output device drawing
+** the objects detected on a downscaled luma plane and tracked between
+** detections, objects can be written as JSON lines
 ** 
 ** -------------------------------------------------------------------------*/
 
@@ -19,9 +21,6 @@
 
 #include <fstream>
 
-#include <opencv/cv.h>
-#include <opencv/highgui.h>
-#include <opencv/ml.h>
 #include <opencv2/objdetect.hpp>
 #include <opencv2/imgproc.hpp>
 
@@ -33,8 +32,27 @@
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
 
+#include "objectdetector.h"
+#include "objecttracker.h"
+#include "framestamp.h"
+
 int stop=0;
 
+/* ---------------------------------------------------------------------------
+**  draw a rectangle in the planes of an I420 frame
+** -------------------------------------------------------------------------*/
+void drawRect(uint8_t* y, uint8_t* u, uint8_t* v, int width, int height, const cv::Rect & r)
+{
+	// green in BT.601
+	cv::Mat luma(height, width, CV_8UC1, y);
+	cv::rectangle(luma, r, cv::Scalar(145), 2);
+	cv::Rect c(r.x/2, r.y/2, r.width/2, r.height/2);
+	cv::Mat cb(height/2, width/2, CV_8UC1, u);
+	cv::rectangle(cb, c, cv::Scalar(54), 1);
+	cv::Mat cr(height/2, width/2, CV_8UC1, v);
+	cv::rectangle(cr, c, cv::Scalar(34), 1);
+}
+
 /* ---------------------------------------------------------------------------
 **  SIGINT handler
 ** -------------------------------------------------------------------------*/
@@ -56,18 +74,32 @@ int main(int argc, char* argv[])
 	V4l2IoType ioTypeIn  = IOTYPE_MMAP;
 	V4l2IoType ioTypeOut = IOTYPE_MMAP;
 	std::string outFormatStr = "YU12";
+	int width = 640;
+	int height = 480;
+	int detectWidth = 320;
+	int interval = 5;
+	std::string cascadeName = "/usr/share/opencv/haarcascades/haarcascade_frontalface_default.xml";
+	std::string metadata;
+	bool draw = true;
 	
-	while ((c = getopt (argc, argv, "hv::" "o:" "rw")) != -1)
+	while ((c = getopt (argc, argv, "hv::" "o:" "rw" "W:H:" "c:d:D:" "m:n")) != -1)
 	{
 		switch (c)
 		{
 			case 'v':	verbose = 1; if (optarg && *optarg=='v') verbose++;  break;
 			case 'h':
 			{
-				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
+				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] [-o format] [-c cascade] [-d width] [-D interval] [-m metadata] [-n] source_device dest_device" << std::endl;
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
-				std::cout << "\t -o <format>   : output YUV format" << std::endl;
+				std::cout << "\t -W width      : V4L2 capture width (default "<< width << ")" << std::endl;
+				std::cout << "\t -H height     : V4L2 capture height (default "<< height << ")" << std::endl;
+				std::cout << "\t -o <format>   : output YUV format (default "<< outFormatStr << ")" << std::endl;
+				std::cout << "\t -c cascade    : cascade classifier (default "<< cascadeName << ")" << std::endl;
+				std::cout << "\t -d width      : width of the luma plane used for the detection (default "<< detectWidth << ")" << std::endl;
+				std::cout << "\t -D interval   : run the detection every interval frames (default "<< interval << ")" << std::endl;
+				std::cout << "\t -m metadata   : write detected and tracked objects of each frame as JSON lines to a file (- for stdout)" << std::endl;
+				std::cout << "\t -n            : do not draw the objects in the frames" << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
@@ -77,6 +109,13 @@ int main(int argc, char* argv[])
 			case 'r':	ioTypeIn  = IOTYPE_READWRITE; break;			
 			case 'w':	ioTypeOut = IOTYPE_READWRITE; break;	
 			case 'o':       outFormatStr = optarg ; break;
+			case 'W':	width = atoi(optarg); break;
+			case 'H':	height = atoi(optarg); break;
+			case 'c':	cascadeName = optarg; break;
+			case 'd':	detectWidth = atoi(optarg); break;
+			case 'D':	interval = atoi(optarg); break;
+			case 'm':	metadata = optarg; break;
+			case 'n':	draw = false; break;
 			default:
 				std::cout << "option :" << c << " is unknown" << std::endl;
 				break;
@@ -98,17 +137,11 @@ int main(int argc, char* argv[])
 		outFormatStr.append(" ");
 	}
 	
-
-	const char *cascade_name = "/usr/share/opencv/haarcascades/haarcascade_frontalface_default.xml";
-	cv::CascadeClassifier cascade;
-	cascade.load(cascade_name);
-  
-    
 	// initialize log4cpp
 	initLogger(verbose);
 
 	// init V4L2 capture interface
-	V4L2DeviceParameters param(in_devname, v4l2_fourcc('Y', 'U', 'Y', 'V'), 640, 480, 0, ioTypeIn, verbose);
+	V4L2DeviceParameters param(in_devname, v4l2_fourcc('Y', 'U', 'Y', 'V'), width, height, 0, ioTypeIn, verbose);
 	V4l2Capture* videoCapture = V4l2Capture::create(param);
 	
 	if (videoCapture == NULL)
@@ -118,11 +151,11 @@ int main(int argc, char* argv[])
 	else
 	{
 		int informat =  videoCapture->getFormat();
-		int width    =  videoCapture->getWidth();		
-		int height   =  videoCapture->getHeight();
+		width    =  videoCapture->getWidth();		
+		height   =  videoCapture->getHeight();
 				
 		// init V4L2 output interface
-		int outformat =  v4l2_fourcc('B', 'G', 'R', '3'); //v4l2_fourcc(outFormatStr[0],outFormatStr[1],outFormatStr[2],outFormatStr[3]);
+		int outformat =  v4l2_fourcc(outFormatStr[0],outFormatStr[1],outFormatStr[2],outFormatStr[3]);
 		V4L2DeviceParameters outparam(out_devname, outformat, videoCapture->getWidth(), videoCapture->getHeight(), 0, ioTypeOut, verbose);
 		V4l2Output* videoOutput = V4l2Output::create(outparam);
 		if (videoOutput == NULL)
@@ -138,11 +171,34 @@ int main(int argc, char* argv[])
 			}
 			else
 			{
-				// intermediate I420 image
-				uint8_t i420[width*height*2];
-				uint8_t* i420_p0=i420;
-				uint8_t* i420_p1=&i420[width*height];
-				uint8_t* i420_p2=&i420[width*height*3/2];								
+				// intermediate I420 image, boxes are drawn on it and it is converted once to the output format
+				std::vector<uint8_t> i420(width*height*3/2);
+				uint8_t* i420_p0=i420.data();
+				uint8_t* i420_p1=i420_p0 + width*height;
+				uint8_t* i420_p2=i420_p1 + width*height/4;
+				std::vector<char> outBuffer(videoOutput->getBufferSize());
+				
+				// detection runs on a downscaled luma plane from its own thread
+				ObjectDetector detector(cascadeName, width, height, detectWidth, interval);
+				unsigned int frameIndex = 0;
+				
+				// objects are followed on a plane of the detection size between detections
+				ObjectTracker tracker(width, height, detector.getDetectWidth(), detector.getDetectHeight());
+				std::vector<cv::Rect> detected;
+				std::vector<uint8_t> detectedPlane;
+				
+				std::ofstream metadataFile;
+				std::ostream* metadataStream = NULL;
+				if (metadata == "-") {
+					metadataStream = &std::cout;
+				} else if (!metadata.empty()) {
+					metadataFile.open(metadata.c_str());
+					if (metadataFile.is_open()) {
+						metadataStream = &metadataFile;
+					} else {
+						LOG(WARN) << "Cannot open metadata file:" << metadata;
+					}
+				}
 				
 				timeval tv;
 				
@@ -173,30 +229,44 @@ int main(int argc, char* argv[])
 								width, height,
 								libyuv::kRotate0, informat);
 
+							detector.process(i420_p0, width, frameIndex);
+							
+							// a new result restarts the tracking from the frame it was detected on
+							unsigned int detectedIndex = 0;
+							if (detector.getResult(detected, detectedPlane, detectedIndex))
+							{
+								LOG(DEBUG) << "objects " << detected.size() << " detected on frame " << detectedIndex << " at frame " << frameIndex; 
+								tracker.reset(detected, detectedPlane.data());
+							}
+							const std::vector<TrackedObject> & objects = tracker.track(i420_p0, width);
+							
+							if (metadataStream)
+							{
+								FrameStamp stamp;
+								bool stamped = stamp.extract(informat, (const uint8_t*)inbuffer, rsize, width, height);
+								tracker.writeJson(*metadataStream, frameIndex, FrameStamp::now(), stamped ? stamp.sequence : -1);
+							}
+							if (draw)
+							{
+								for (const TrackedObject & obj : objects) 
+								{
+									if (!obj.lost)
+									{
+										drawRect(i420_p0, i420_p1, i420_p2, width, height, obj.rect);
+									}
+								}
+							}
+							frameIndex++;
 							
-							char outBuffer[width*height*3];
 							libyuv::ConvertFromI420(i420_p0, width,
 									i420_p1, width/2,
 									i420_p2, width/2,
-									(uint8_t*)outBuffer, 0,
+									(uint8_t*)outBuffer.data(), 0,
 									width, height, 
 									outformat);
 							
-							
-
-							cv::Mat input(width, height, CV_8UC3, outBuffer);
-                                                        std::vector<cv::Rect> faces;
-                                                        cascade.detectMultiScale( input, faces, 1.11, 4, 0);
-							LOG(NOTICE) << "faces " << faces.size(); 
-							for (cv::Rect r : faces) 
-							{
-								LOG(NOTICE) << r.x << "x" << r.y << " -> " << r.x+r.width << "x" << r.y+r.height ;
-								cv::rectangle( input, r, cv::Scalar(255,0,0) );
-							}
-							
-							int wsize = videoOutput->write((char*)input.data, width*height*3);
+							int wsize = videoOutput->write(outBuffer.data(), outBuffer.size());
 							LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
-							
 						}
 					}
 					else if (ret == -1)
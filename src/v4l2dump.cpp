@@ -16,6 +16,10 @@
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <fstream>
 
@@ -29,6 +33,10 @@
 #include "hevc_stream.h"
 #include "libyuv.h"
 
+#include "nalscanner.h"
+#include "streamstats.h"
+#include "framesplitter.h"
+
 int stop=0;
 
 /* ---------------------------------------------------------------------------
@@ -40,6 +48,114 @@ void sighandler(int)
        stop =1;
 }
 
+/* ---------------------------------------------------------------------------
+**  dump one frame, arrival in microseconds
+** -------------------------------------------------------------------------*/
+void dump(int format, uint8_t* buffer, int rsize, unsigned long long arrival, StreamStats* streamStats, h264_stream_t* h264, hevc_stream_t* hevc)
+{
+	LOG(DEBUG) << "size:" << rsize;
+	if (streamStats) {
+		streamStats->add(buffer, rsize, arrival);
+	}
+	else if ( (format == V4L2_PIX_FMT_H264) || (format == V4L2_PIX_FMT_HEVC) ) {
+		// single pass over the NAL units of the frame
+		NalSplitter splitter(buffer, rsize, format == V4L2_PIX_FMT_HEVC);
+		NalUnit nal;
+		while (splitter.next(nal)) {
+			LOG(DEBUG) << "nal offset:" << nal.offset << " size:" << nal.size << " type:" << nal.type;
+			if (format == V4L2_PIX_FMT_H264) {
+				read_debug_nal_unit(h264, buffer + nal.offset, nal.size);
+			} else {
+				read_debug_hevc_nal_unit(hevc, buffer + nal.offset, nal.size);
+			}
+		}
+	}
+#ifdef HAVE_JPEG
+	else if ( (format == V4L2_PIX_FMT_JPEG) 
+	        ||(format == V4L2_PIX_FMT_MJPEG) ) {		
+		int width = 0;
+		int height = 0;
+		if (libyuv::MJPGSize((const uint8_t*)buffer, rsize, &width, &height) == 0) {
+			LOG(NOTICE) << "libyuv::MJPGSize " << width << "x" << height; 
+		} else {
+			LOG(WARN) << "libyuv::MJPGSize error"; 
+		}
+	}
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+**  guess the format of a recorded file from its extension
+** -------------------------------------------------------------------------*/
+int fileFormat(const std::string & path)
+{
+	int format = 0;
+	std::string ext = path.substr(path.find_last_of('.') + 1);
+	if ( (ext == "h264") || (ext == "264") ) {
+		format = V4L2_PIX_FMT_H264;
+	} else if ( (ext == "h265") || (ext == "265") || (ext == "hevc") ) {
+		format = V4L2_PIX_FMT_HEVC;
+	} else if ( (ext == "mjpeg") || (ext == "mjpg") || (ext == "jpg") || (ext == "jpeg") ) {
+		format = V4L2_PIX_FMT_MJPEG;
+	}
+	return format;
+}
+
+/* ---------------------------------------------------------------------------
+**  dump a recorded file, mapped in memory and split in frames
+**  frames are timestamped at the nominal frame rate to get the stream statistics
+** -------------------------------------------------------------------------*/
+int dumpFile(const char* path, int format, int fps, bool stats)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		LOG(WARN) << "Cannot open " << path << " " << strerror(errno);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		LOG(WARN) << "Cannot stat " << path << " " << strerror(errno);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	// read only mapping, the debug parsers take non const buffers but do not write to them
+	const uint8_t* data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		LOG(WARN) << "Cannot map " << path << " " << strerror(errno);
+		return -1;
+	}
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	h264_stream_t* h264 = h264_new();
+	hevc_stream_t* hevc = hevc_new();
+	StreamStats* streamStats = stats ? new StreamStats(format) : NULL;
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	FrameSplitter splitter(format, data, st.st_size);
+	const uint8_t* frame = NULL;
+	size_t size = 0;
+	unsigned long long count = 0;
+	while (!stop && splitter.next(frame, size)) {
+		dump(format, const_cast<uint8_t*>(frame), size, count*1000000ULL/fps, streamStats, h264, hevc);
+		count++;
+	}
+	delete streamStats;
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+	LOG(NOTICE) << path << " frames:" << count << " size:" << st.st_size << " elapsed:" << elapsed << "s " << (st.st_size/elapsed/1e6) << " MB/s " << (count/elapsed) << " frames/s";
+
+	munmap((void*)data, st.st_size);
+	return 0;
+}
+
 /* ---------------------------------------------------------------------------
 **  main
 ** -------------------------------------------------------------------------*/
@@ -49,20 +165,31 @@ int main(int argc, char* argv[])
 	const char *in_devname = "/dev/video0";	
 	int c = 0;
 	V4l2IoType ioTypeIn  = IOTYPE_MMAP;
+	bool stats = false;
+	std::string strformat;
+	int fps = 25;
 	
-	while ((c = getopt (argc, argv, "hP:F:v::rw")) != -1)
+	while ((c = getopt (argc, argv, "hP:F:v::rwsf:")) != -1)
 	{
 		switch (c)
 		{
 			case 'v':	verbose   = 1; if (optarg && *optarg=='v') verbose++;  break;
 			case 'r':	ioTypeIn  = IOTYPE_READWRITE; break;			
+			case 's':	stats     = true; break;
+			case 'f':	strformat = optarg; break;
+			case 'F':	fps       = atoi(optarg); break;
 			case 'h':
 			{
-				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
+				std::cout << argv[0] << " [-v[v]] [-r] [-s] [-f format] [-F fps] source_device|file" << std::endl;
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
+				std::cout << "\t -s            : print statistics every second as JSON lines instead of dumping NAL units" << std::endl;
+				std::cout << "\t                 latency histogram is added for frames stamped by v4l2source_yuv (pattern stamp)" << std::endl;
+				std::cout << "\t -f format     : format of a recorded file H264, HEVC or MJPG (default from the extension)" << std::endl;
+				std::cout << "\t -F fps        : frame rate of a recorded file used to timestamp its frames (default "<< fps << ")" << std::endl;
 				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
+				std::cout << "\t file          : recorded Annex-B H264/HEVC or MJPEG file, parsed as fast as possible" << std::endl;
 				exit(0);
 			}
 		}
@@ -76,6 +203,23 @@ int main(int argc, char* argv[])
 	// initialize log4cpp
 	initLogger(verbose);
 
+	struct stat st;
+	if ( (stat(in_devname, &st) == 0) && S_ISREG(st.st_mode) )
+	{
+		int format = strformat.empty() ? fileFormat(in_devname) : V4l2Device::fourcc(strformat.c_str());
+		if ( (format != V4L2_PIX_FMT_H264) && (format != V4L2_PIX_FMT_HEVC) && (format != V4L2_PIX_FMT_MJPEG) && (format != V4L2_PIX_FMT_JPEG) )
+		{
+			LOG(WARN) << "Unsupported format for file:" << in_devname;
+			return -1;
+		}
+		if (fps <= 0)
+		{
+			fps = 25;
+		}
+		signal(SIGINT,sighandler);
+		return dumpFile(in_devname, format, fps, stats);
+	}
+
 	// init V4L2 capture interface
 	V4L2DeviceParameters param(in_devname, 0, 0, 0, 0, ioTypeIn, verbose);
 	V4l2Capture* videoCapture = V4l2Capture::create(param);
@@ -88,6 +232,8 @@ int main(int argc, char* argv[])
 	{
 		h264_stream_t* h264 = h264_new();
 		hevc_stream_t* hevc = hevc_new();
+		// live frames are compared with the FrameStamp of the source to measure latency
+		StreamStats streamStats(videoCapture->getFormat(), true, videoCapture->getWidth(), videoCapture->getHeight());
 		
 		timeval tv;
 		
@@ -109,37 +255,9 @@ int main(int argc, char* argv[])
 				}
 				else
 				{
-					int nal_start = 0, nal_end = 0;
-					uint8_t* p = (uint8_t*)buffer;
-					LOG(DEBUG) << "size:" << rsize;
-					if (videoCapture->getFormat() == V4L2_PIX_FMT_H264) {		
-						while ((find_nal_unit(p, rsize, &nal_start, &nal_end)>=-1) && (nal_end>nal_start)) {
-							p += nal_start;
-							read_debug_nal_unit(h264, p, nal_end - nal_start);
-							p += (nal_end - nal_start);
-							rsize -= nal_end;
-						}
-					}
-					else if (videoCapture->getFormat() == V4L2_PIX_FMT_HEVC) {		
-						while ( (find_nal_unit(p, rsize, &nal_start, &nal_end)>=-1) && (nal_end>nal_start)) {
-							p += nal_start;
-							read_debug_hevc_nal_unit(hevc, p, nal_end - nal_start);							
-							p += (nal_end - nal_start);
-							rsize -= nal_end;
-						}
-					}
-#ifdef HAVE_JPEG
-					else if ( (videoCapture->getFormat() == V4L2_PIX_FMT_JPEG) 
-					        ||(videoCapture->getFormat() == V4L2_PIX_FMT_MJPEG) ) {		
-						int width = 0;
-						int height = 0;
-						if (libyuv::MJPGSize((const uint8_t*)buffer, rsize, &width, &height) == 0) {
-							LOG(NOTICE) << "libyuv::MJPGSize " << width << "x" << height; 
-						} else {
-							LOG(WARN) << "libyuv::MJPGSize error"; 
-						}
-					}
-#endif
+					timespec ts;
+					clock_gettime(CLOCK_MONOTONIC, &ts);
+					dump(videoCapture->getFormat(), (uint8_t*)buffer, rsize, ts.tv_sec*1000000ULL + ts.tv_nsec/1000, stats ? &streamStats : NULL, h264, hevc);
 				}
 			}
 			else if (ret == -1)
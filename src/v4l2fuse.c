@@ -1,5 +1,26 @@
-
-
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** v4l2fuse.c
+**
+** V4L2 loopback device in userspace using CUSE
+**  - writers push frames with write() or VIDIOC_QBUF on the output queue
+**  - readers get them with read() or VIDIOC_QBUF/VIDIOC_DQBUF on the capture queue
+**  - the last frames are kept in a ring, each open file reads at its own position
+**
+** CUSE has no way to block a request, a read or a DQBUF without frame is kept
+** pending and replied when a writer pushes the next frame, or with EINTR when
+** the caller is interrupted. Requests are served by the multi-threaded session
+** loop (-s for single thread), the device state is protected by one mutex.
+**
+** CUSE does not forward mmap, V4L2_MEMORY_MMAP buffers are slots of a POSIX
+** shared memory (/dev/shm/v4l2fuse-<devname>), QUERYBUF gives the offset of
+** the slot that clients map from this file instead of the device. Frames are
+** then exchanged by buffer index, the payload never goes through CUSE.
+**
+** -------------------------------------------------------------------------*/
 
 #define FUSE_USE_VERSION 31
 
@@ -11,100 +32,813 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/kdev_t.h>
 #include <linux/videodev2.h>
 
+#define RING_SIZE    4
+#define MAX_BUFFERS  32
+#define MAX_SLOTS    64
+#define MIN_SIZE     16
+#define MAX_SIZE     8192
+
+struct format {
+	unsigned int pixelformat;
+	const char  *description;
+	unsigned int flags;
+};
+
+static const struct format formats[] = {
+	{ V4L2_PIX_FMT_YUYV,   "YUYV 4:2:2",       0                        },
+	{ V4L2_PIX_FMT_NV12,   "Y/CbCr 4:2:0",     0                        },
+	{ V4L2_PIX_FMT_YUV420, "Planar YUV 4:2:0", 0                        },
+	{ V4L2_PIX_FMT_MJPEG,  "Motion-JPEG",      V4L2_FMT_FLAG_COMPRESSED },
+	{ V4L2_PIX_FMT_H264,   "H.264",            V4L2_FMT_FLAG_COMPRESSED },
+	{ V4L2_PIX_FMT_HEVC,   "HEVC",             V4L2_FMT_FLAG_COMPRESSED },
+};
+
+struct frame {
+	char          *data;
+	size_t         size;
+	size_t         bytesused;
+	unsigned long  sequence;
+	struct timeval timestamp;
+};
+
+struct buffer {
+	unsigned long userptr;
+	size_t        length;
+	int           slot;           /* shared memory slot of MMAP buffers */
+};
+
+/* buffers of a queue */
+struct bufset {
+	unsigned int  memory;
+	unsigned int  count;
+	struct buffer bufs[MAX_BUFFERS];
+};
+
+/* FIFO of buffer indexes */
+struct bufqueue {
+	unsigned int index[MAX_BUFFERS];
+	unsigned int head;
+	unsigned int count;
+};
+
+struct client {
+	unsigned long           next;          /* sequence of the next frame to read */
+	int                     nonblock;
+	int                     streaming;
+	struct bufset           capture;
+	struct bufset           output;
+	struct bufqueue         queued;        /* capture buffers waiting for a frame */
+	struct bufqueue         done;          /* output buffers consumed */
+	struct fuse_pollhandle *ph;
+	fuse_req_t              pending;       /* read or DQBUF waiting for a frame */
+	size_t                  pending_size;  /* size of the pending read, 0 for DQBUF */
+	struct v4l2_buffer      pending_buf;
+	struct client          *next_client;
+};
+
+/* shared memory backing MMAP buffers */
+struct pool {
+	char           name[64];
+	int            fd;
+	char          *base;
+	size_t         slot_size;
+	unsigned char  used[MAX_SLOTS];
+};
+
+struct device {
+	struct v4l2_format  fmt;
+	struct v4l2_fract   timeperframe;
+	struct frame        ring[RING_SIZE];
+	unsigned long       sequence;          /* number of frames written */
+	struct client      *clients;
+	struct pool         pool;
+	pthread_mutex_t     lock;              /* recursive, interrupt callbacks may run in fuse_req_interrupt_func */
+};
+
+static struct device dev;
+
+static const struct format *find_format(unsigned int pixelformat)
+{
+	for (unsigned int i = 0; i < sizeof(formats)/sizeof(formats[0]); i++) {
+		if (formats[i].pixelformat == pixelformat) {
+			return &formats[i];
+		}
+	}
+	return NULL;
+}
+
+static unsigned int clamp_size(unsigned int value)
+{
+	if (value < MIN_SIZE) {
+		return MIN_SIZE;
+	} else if (value > MAX_SIZE) {
+		return MAX_SIZE;
+	}
+	return value;
+}
+
+/* adjust a format to a supported one and compute its frame size */
+static void try_format(struct v4l2_pix_format *pix)
+{
+	if (find_format(pix->pixelformat) == NULL) {
+		pix->pixelformat = dev.fmt.fmt.pix.pixelformat;
+	}
+	/* chroma is subsampled horizontally for all formats and vertically for 4:2:0 */
+	pix->width = clamp_size(pix->width) & ~1U;
+	pix->height = clamp_size(pix->height) & ~1U;
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = (pix->pixelformat == V4L2_PIX_FMT_MJPEG) ? V4L2_COLORSPACE_JPEG : V4L2_COLORSPACE_SRGB;
+
+	size_t pixels = (size_t)pix->width * pix->height;
+	switch (pix->pixelformat) {
+		case V4L2_PIX_FMT_YUYV:
+			pix->bytesperline = pix->width * 2;
+			pix->sizeimage = pix->bytesperline * pix->height;
+			break;
+		case V4L2_PIX_FMT_NV12:
+		case V4L2_PIX_FMT_YUV420:
+			pix->bytesperline = pix->width;
+			pix->sizeimage = pixels * 3 / 2;
+			break;
+		case V4L2_PIX_FMT_MJPEG:
+			/* large enough for high quality frames, a bigger size asked by the client is kept */
+			pix->bytesperline = 0;
+			if (pix->sizeimage < pixels * 2) {
+				pix->sizeimage = pixels * 2;
+			}
+			break;
+		default:
+			pix->bytesperline = 0;
+			if (pix->sizeimage < pixels * 3 / 2) {
+				pix->sizeimage = pixels * 3 / 2;
+			}
+			break;
+	}
+	if (pix->sizeimage > pixels * 4) {
+		pix->sizeimage = pixels * 4;
+	}
+}
+
+static void queue_push(struct bufqueue *q, unsigned int index)
+{
+	q->index[(q->head + q->count) % MAX_BUFFERS] = index;
+	q->count++;
+}
+
+static unsigned int queue_pop(struct bufqueue *q)
+{
+	unsigned int index = q->index[q->head];
+	q->head = (q->head + 1) % MAX_BUFFERS;
+	q->count--;
+	return index;
+}
+
+/* slots are sized for the current format, the file is sparse so unused slots cost nothing */
+static int pool_resize(size_t sizeimage)
+{
+	struct pool *pool = &dev.pool;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t slot_size = (sizeimage + page - 1) / page * page;
+	if (slot_size == pool->slot_size) {
+		return 0;
+	}
+	if (pool->base) {
+		munmap(pool->base, pool->slot_size * MAX_SLOTS);
+		pool->base = NULL;
+	}
+	if (ftruncate(pool->fd, slot_size * MAX_SLOTS) != 0) {
+		fprintf(stderr, "Cannot resize %s:%s\n", pool->name, strerror(errno));
+		return -1;
+	}
+	void *base = mmap(NULL, slot_size * MAX_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s:%s\n", pool->name, strerror(errno));
+		return -1;
+	}
+	pool->base = base;
+	pool->slot_size = slot_size;
+	return 0;
+}
+
+static int pool_open(const char *devname)
+{
+	struct pool *pool = &dev.pool;
+	snprintf(pool->name, sizeof(pool->name), "/v4l2fuse-%s", devname);
+	pool->fd = shm_open(pool->name, O_RDWR | O_CREAT, 0660);
+	if (pool->fd < 0) {
+		fprintf(stderr, "Cannot open %s:%s\n", pool->name, strerror(errno));
+		return -1;
+	}
+	/* frames are readable and writable by the owner and group only, like a video device node,
+	   a pool left by a previous run keeps its mode so it is set again */
+	if (fchmod(pool->fd, 0660) != 0) {
+		fprintf(stderr, "Cannot set mode of %s:%s\n", pool->name, strerror(errno));
+	}
+	fprintf(stderr, "MMAP buffers are mapped from /dev/shm%s\n", pool->name);
+	return pool_resize(dev.fmt.fmt.pix.sizeimage);
+}
+
+static int pool_in_use(void)
+{
+	for (int i = 0; i < MAX_SLOTS; i++) {
+		if (dev.pool.used[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static char *slot_data(int slot)
+{
+	return dev.pool.base + slot * dev.pool.slot_size;
+}
+
+static void bufset_free(struct bufset *set)
+{
+	for (unsigned int i = 0; i < set->count; i++) {
+		if (set->memory == V4L2_MEMORY_MMAP) {
+			dev.pool.used[set->bufs[i].slot] = 0;
+		}
+	}
+	memset(set, 0, sizeof(*set));
+}
+
+/* allocate shared memory slots for MMAP, return the number of buffers */
+static unsigned int bufset_alloc(struct bufset *set, unsigned int memory, unsigned int count)
+{
+	bufset_free(set);
+	set->memory = memory;
+	if (count > MAX_BUFFERS) {
+		count = MAX_BUFFERS;
+	}
+	while (set->count < count) {
+		struct buffer *buf = &set->bufs[set->count];
+		if (memory == V4L2_MEMORY_MMAP) {
+			int slot = 0;
+			while (slot < MAX_SLOTS && dev.pool.used[slot]) {
+				slot++;
+			}
+			if (slot == MAX_SLOTS || dev.pool.base == NULL) {
+				break;
+			}
+			dev.pool.used[slot] = 1;
+			buf->slot = slot;
+			buf->length = dev.fmt.fmt.pix.sizeimage;
+		}
+		set->count++;
+	}
+	return set->count;
+}
+
+static struct client *get_client(struct fuse_file_info *fi)
+{
+	return (struct client *)(uintptr_t)fi->fh;
+}
+
+/* next frame for a client, slow clients skip to the oldest frame of the ring */
+static struct frame *next_frame(struct client *c)
+{
+	struct frame *f = NULL;
+	if (c->next < dev.sequence) {
+		if (dev.sequence - c->next > RING_SIZE) {
+			c->next = dev.sequence - RING_SIZE;
+		}
+		f = &dev.ring[c->next % RING_SIZE];
+		c->next++;
+	}
+	return f;
+}
+
+static void reply_read(fuse_req_t req, size_t size, struct frame *f)
+{
+	fuse_reply_buf(req, f->data, (f->bytesused < size) ? f->bytesused : size);
+}
+
+/* fill the first queued capture buffer, USERPTR data is copied out by the retry of DQBUF */
+static void reply_dqbuf(fuse_req_t req, struct client *c, struct v4l2_buffer *buf, struct frame *f)
+{
+	unsigned int index = queue_pop(&c->queued);
+	struct buffer *b = &c->capture.bufs[index];
+	size_t size = (f->bytesused < b->length) ? f->bytesused : b->length;
+
+	buf->index = index;
+	buf->memory = c->capture.memory;
+	buf->bytesused = size;
+	buf->flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	buf->field = V4L2_FIELD_NONE;
+	buf->timestamp = f->timestamp;
+	buf->sequence = f->sequence;
+	buf->length = b->length;
+
+	if (c->capture.memory == V4L2_MEMORY_MMAP) {
+		buf->m.offset = b->slot * dev.pool.slot_size;
+		memcpy(slot_data(b->slot), f->data, size);
+		fuse_reply_ioctl(req, 0, buf, sizeof(*buf));
+	} else {
+		buf->m.userptr = b->userptr;
+		struct iovec iov[2] = { { buf, sizeof(*buf) }, { f->data, size } };
+		fuse_reply_ioctl_iov(req, 0, iov, 2);
+	}
+}
+
+/* the interrupted request may belong to any client, the client itself may be gone,
+   only a request already recorded as pending is replied here */
+static void interrupt_pending(fuse_req_t req, void *data)
+{
+	pthread_mutex_lock(&dev.lock);
+	for (struct client *c = dev.clients; c != NULL; c = c->next_client) {
+		if (c->pending == req) {
+			c->pending = NULL;
+			fuse_reply_err(req, EINTR);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dev.lock);
+}
+
+/* keep a read or a DQBUF until the next frame */
+static void defer_reply(fuse_req_t req, struct client *c, size_t size, const struct v4l2_buffer *buf)
+{
+	/* for a request already interrupted libfuse runs the callback now while it holds the request,
+	   the callback does not find it pending and the reply is sent here */
+	fuse_req_interrupt_func(req, interrupt_pending, NULL);
+	if (fuse_req_interrupted(req)) {
+		fuse_reply_err(req, EINTR);
+		return;
+	}
+	c->pending = req;
+	c->pending_size = size;
+	if (buf) {
+		c->pending_buf = *buf;
+	}
+}
+
+/* store a frame in the ring and wake up the readers */
+static void push_frame(const char *data, size_t size)
+{
+	struct frame *f = &dev.ring[dev.sequence % RING_SIZE];
+	if (f->size < size) {
+		char *buffer = realloc(f->data, size);
+		if (buffer == NULL) {
+			return;
+		}
+		f->data = buffer;
+		f->size = size;
+	}
+	memcpy(f->data, data, size);
+	f->bytesused = size;
+	f->sequence = dev.sequence;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	f->timestamp.tv_sec = ts.tv_sec;
+	f->timestamp.tv_usec = ts.tv_nsec / 1000;
+	dev.sequence++;
+
+	for (struct client *c = dev.clients; c != NULL; c = c->next_client) {
+		if (c->pending) {
+			fuse_req_t req = c->pending;
+			c->pending = NULL;
+			struct frame *next = next_frame(c);
+			if (c->pending_size) {
+				reply_read(req, c->pending_size, next);
+			} else {
+				reply_dqbuf(req, c, &c->pending_buf, next);
+			}
+		}
+		if (c->ph) {
+			fuse_lowlevel_notify_poll(c->ph);
+			fuse_pollhandle_destroy(c->ph);
+			c->ph = NULL;
+		}
+	}
+}
+
 static void v4l2_open(fuse_req_t req, struct fuse_file_info *fi)
 {
-	fprintf(stderr, "v4l2_open\n");
+	struct client *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_mutex_lock(&dev.lock);
+	c->next = dev.sequence;
+	c->nonblock = (fi->flags & O_NONBLOCK) != 0;
+	c->next_client = dev.clients;
+	dev.clients = c;
+	pthread_mutex_unlock(&dev.lock);
+
+	fi->fh = (uintptr_t)c;
+	fi->nonseekable = 1;
+	fi->direct_io = 1;
 	fuse_reply_open(req, fi);
 }
 
+static void v4l2_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct client *c = get_client(fi);
+	pthread_mutex_lock(&dev.lock);
+	for (struct client **it = &dev.clients; *it != NULL; it = &(*it)->next_client) {
+		if (*it == c) {
+			*it = c->next_client;
+			break;
+		}
+	}
+	if (c->ph) {
+		fuse_pollhandle_destroy(c->ph);
+	}
+	bufset_free(&c->capture);
+	bufset_free(&c->output);
+	pthread_mutex_unlock(&dev.lock);
+	free(c);
+	fuse_reply_err(req, 0);
+}
+
 static void v4l2_read(fuse_req_t req, size_t size, off_t off,
 		      struct fuse_file_info *fi)
 {
-	fprintf(stderr, "v4l2_read\n");	
-	
-	fuse_reply_buf(req, NULL, 0);
+	struct client *c = get_client(fi);
+	pthread_mutex_lock(&dev.lock);
+	struct frame *f = next_frame(c);
+	if (f) {
+		reply_read(req, size, f);
+	} else if (c->nonblock) {
+		fuse_reply_err(req, EAGAIN);
+	} else if (c->pending) {
+		fuse_reply_err(req, EBUSY);
+	} else {
+		defer_reply(req, c, size ? size : 1, NULL);
+	}
+	pthread_mutex_unlock(&dev.lock);
 }
 
 static void v4l2_write(fuse_req_t req, const char *buf, size_t size, off_t off,
 		       struct fuse_file_info *fi)
 {
-	fprintf(stderr, "v4l2_write\n");
-
+	pthread_mutex_lock(&dev.lock);
+	push_frame(buf, size);
+	pthread_mutex_unlock(&dev.lock);
 	fuse_reply_write(req, size);
 }
 
+static void v4l2_poll(fuse_req_t req, struct fuse_file_info *fi,
+		      struct fuse_pollhandle *ph)
+{
+	struct client *c = get_client(fi);
+	unsigned revents = POLLOUT | POLLWRNORM;
+	pthread_mutex_lock(&dev.lock);
+	if (c->next < dev.sequence) {
+		revents |= POLLIN | POLLRDNORM;
+	}
+	if (ph) {
+		if (c->ph) {
+			fuse_pollhandle_destroy(c->ph);
+		}
+		c->ph = ph;
+	}
+	pthread_mutex_unlock(&dev.lock);
+	fuse_reply_poll(req, revents);
+}
+
+/* ask the kernel to copy the ioctl argument, return 1 when it is available */
+static int ioctl_arg(fuse_req_t req, void *arg, size_t size, int in, int out,
+		     size_t in_bufsz, size_t out_bufsz)
+{
+	struct iovec iov = { arg, size };
+	if ( (in && in_bufsz < size) || (out && out_bufsz < size) ) {
+		fuse_reply_ioctl_retry(req, in ? &iov : NULL, in ? 1 : 0, out ? &iov : NULL, out ? 1 : 0);
+		return 0;
+	}
+	return 1;
+}
+
+static struct bufset *get_bufset(struct client *c, unsigned int type)
+{
+	if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		return &c->capture;
+	} else if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+		return &c->output;
+	}
+	return NULL;
+}
+
+static void ioctl_reqbufs(fuse_req_t req, struct client *c, struct v4l2_requestbuffers *in)
+{
+	struct v4l2_requestbuffers reqbufs = *in;
+	struct bufset *set = get_bufset(c, reqbufs.type);
+	if (set == NULL || (reqbufs.memory != V4L2_MEMORY_USERPTR && reqbufs.memory != V4L2_MEMORY_MMAP)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	/* like V4L2 drivers, capture buffers cannot change while streaming or waited by a DQBUF */
+	if (set == &c->capture && (c->streaming || (c->pending && !c->pending_size))) {
+		fuse_reply_err(req, EBUSY);
+		return;
+	}
+	if (set == &c->capture) {
+		memset(&c->queued, 0, sizeof(c->queued));
+	} else {
+		memset(&c->done, 0, sizeof(c->done));
+	}
+	unsigned int count = reqbufs.count;
+	reqbufs.count = bufset_alloc(set, reqbufs.memory, count);
+	if (count && !reqbufs.count) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fuse_reply_ioctl(req, 0, &reqbufs, sizeof(reqbufs));
+}
+
+static void ioctl_querybuf(fuse_req_t req, struct client *c, const void *in_buf)
+{
+	struct v4l2_buffer buf = *(const struct v4l2_buffer *)in_buf;
+	struct bufset *set = get_bufset(c, buf.type);
+	if (set == NULL || buf.index >= set->count) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	struct buffer *b = &set->bufs[buf.index];
+	buf.memory = set->memory;
+	buf.flags = 0;
+	if (set->memory == V4L2_MEMORY_MMAP) {
+		buf.length = b->length;
+		buf.m.offset = b->slot * dev.pool.slot_size;
+	} else {
+		buf.length = b->length ? b->length : dev.fmt.fmt.pix.sizeimage;
+		buf.m.userptr = b->userptr;
+	}
+	fuse_reply_ioctl(req, 0, &buf, sizeof(buf));
+}
+
+static void ioctl_qbuf(fuse_req_t req, struct client *c, void *arg, const void *in_buf,
+		       size_t in_bufsz)
+{
+	struct v4l2_buffer buf = *(const struct v4l2_buffer *)in_buf;
+	struct bufset *set = get_bufset(c, buf.type);
+	if (set == NULL || buf.memory != set->memory || buf.index >= set->count) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	struct buffer *b = &set->bufs[buf.index];
+	if (set == &c->capture) {
+		if (c->queued.count >= MAX_BUFFERS) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		if (set->memory == V4L2_MEMORY_USERPTR) {
+			b->userptr = buf.m.userptr;
+			b->length = buf.length;
+		}
+		queue_push(&c->queued, buf.index);
+	} else {
+		if (c->done.count >= MAX_BUFFERS) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		if (set->memory == V4L2_MEMORY_MMAP) {
+			/* the writer filled the slot, no payload in the request */
+			size_t size = (buf.bytesused < b->length) ? buf.bytesused : b->length;
+			push_frame(slot_data(b->slot), size);
+		} else {
+			/* second retry to get the frame pointed by userptr */
+			if (in_bufsz < sizeof(buf) + buf.bytesused) {
+				struct iovec in_iov[2] = { { arg, sizeof(buf) }, { (void *)buf.m.userptr, buf.bytesused } };
+				struct iovec out_iov = { arg, sizeof(buf) };
+				fuse_reply_ioctl_retry(req, in_iov, 2, &out_iov, 1);
+				return;
+			}
+			push_frame((const char *)in_buf + sizeof(buf), buf.bytesused);
+		}
+		queue_push(&c->done, buf.index);
+	}
+	buf.flags = (buf.flags & ~V4L2_BUF_FLAG_DONE) | V4L2_BUF_FLAG_QUEUED;
+	fuse_reply_ioctl(req, 0, &buf, sizeof(buf));
+}
+
+static void ioctl_dqbuf(fuse_req_t req, struct client *c, void *arg, const void *in_buf,
+			size_t out_bufsz)
+{
+	struct v4l2_buffer buf = *(const struct v4l2_buffer *)in_buf;
+	if (buf.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+		/* frames written by QBUF are already in the ring */
+		if (c->done.count == 0) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		buf.index = queue_pop(&c->done);
+		buf.memory = c->output.memory;
+		buf.flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		if (c->output.memory == V4L2_MEMORY_MMAP) {
+			buf.m.offset = c->output.bufs[buf.index].slot * dev.pool.slot_size;
+		}
+		fuse_reply_ioctl(req, 0, &buf, sizeof(buf));
+	} else if (buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		if (!c->streaming || c->queued.count == 0) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		/* retry to also copy out the frame in the first queued USERPTR buffer */
+		struct buffer *b = &c->capture.bufs[c->queued.index[c->queued.head]];
+		if (c->capture.memory == V4L2_MEMORY_USERPTR && out_bufsz < sizeof(buf) + b->length) {
+			struct iovec in_iov = { arg, sizeof(buf) };
+			struct iovec out_iov[2] = { { arg, sizeof(buf) }, { (void *)b->userptr, b->length } };
+			fuse_reply_ioctl_retry(req, &in_iov, 1, out_iov, 2);
+			return;
+		}
+		struct frame *f = next_frame(c);
+		if (f) {
+			reply_dqbuf(req, c, &buf, f);
+		} else if (c->nonblock) {
+			fuse_reply_err(req, EAGAIN);
+		} else if (c->pending) {
+			fuse_reply_err(req, EBUSY);
+		} else {
+			defer_reply(req, c, 0, &buf);
+		}
+	} else {
+		fuse_reply_err(req, EINVAL);
+	}
+}
+
 static void v4l2_ioctl(fuse_req_t req, int cmd, void *arg,
 		       struct fuse_file_info *fi, unsigned int flags,
 		       const void *in_buf, size_t in_bufsz, size_t out_bufsz)
 {
-	fprintf(stderr, "v4l2_ioctl\n");
+	struct client *c = get_client(fi);
 
 	if (flags & FUSE_IOCTL_COMPAT) {
 			fuse_reply_err(req, ENOSYS);
 			return;
 	}
 
-	static struct v4l2_capability cap;
-	memset(&cap,0,sizeof(cap));
-	cap.capabilities = V4L2_CAP_VIDEO_CAPTURE|V4L2_CAP_VIDEO_OUTPUT|V4L2_CAP_READWRITE;
-	strcpy(cap.driver, "v4l2_cuse");
-	
-	static struct v4l2_format     fmt;
-	memset(&fmt,0,sizeof(fmt));
-	fmt.type  = V4L2_CAP_VIDEO_OUTPUT;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-	fmt.fmt.pix.width = 320;
-	fmt.fmt.pix.height = 200;
-	fmt.fmt.pix.sizeimage = fmt.fmt.pix.width * fmt.fmt.pix.width * 2;
-		
-	switch (cmd) {
+	pthread_mutex_lock(&dev.lock);
+	switch ((unsigned int)cmd) {
 		case VIDIOC_QUERYCAP:
-			fprintf(stderr, "VIDIOC_QUERYCAP\n");
-			if (!out_bufsz) {
-				struct iovec iov = { arg, sizeof(cap) };
-				fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
-			} else {
-				fuse_reply_ioctl(req, 0, &cap, sizeof(cap));		
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_capability), 0, 1, in_bufsz, out_bufsz)) {
+				struct v4l2_capability cap;
+				memset(&cap,0,sizeof(cap));
+				strcpy((char *)cap.driver, "v4l2_cuse");
+				strcpy((char *)cap.card, "v4l2_cuse loopback");
+				strcpy((char *)cap.bus_info, "platform:v4l2_cuse");
+				cap.device_caps = V4L2_CAP_VIDEO_CAPTURE|V4L2_CAP_VIDEO_OUTPUT|V4L2_CAP_READWRITE|V4L2_CAP_STREAMING;
+				cap.capabilities = cap.device_caps|V4L2_CAP_DEVICE_CAPS;
+				fuse_reply_ioctl(req, 0, &cap, sizeof(cap));
+			}
+			break;
+
+		case VIDIOC_ENUM_FMT:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_fmtdesc), 1, 1, in_bufsz, out_bufsz)) {
+				struct v4l2_fmtdesc fmtdesc = *(const struct v4l2_fmtdesc *)in_buf;
+				if (fmtdesc.index >= sizeof(formats)/sizeof(formats[0])
+				    || (fmtdesc.type != V4L2_BUF_TYPE_VIDEO_CAPTURE && fmtdesc.type != V4L2_BUF_TYPE_VIDEO_OUTPUT)) {
+					fuse_reply_err(req, EINVAL);
+				} else {
+					const struct format *format = &formats[fmtdesc.index];
+					memset(fmtdesc.reserved, 0, sizeof(fmtdesc.reserved));
+					fmtdesc.pixelformat = format->pixelformat;
+					fmtdesc.flags = format->flags;
+					snprintf((char *)fmtdesc.description, sizeof(fmtdesc.description), "%s", format->description);
+					fuse_reply_ioctl(req, 0, &fmtdesc, sizeof(fmtdesc));
+				}
 			}
 			break;
-			
+
+		case VIDIOC_TRY_FMT:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_format), 1, 1, in_bufsz, out_bufsz)) {
+				struct v4l2_format fmt = *(const struct v4l2_format *)in_buf;
+				try_format(&fmt.fmt.pix);
+				fuse_reply_ioctl(req, 0, &fmt, sizeof(fmt));
+			}
+			break;
+
 		case VIDIOC_G_FMT:
-			fprintf(stderr, "VIDIOC_G_FMT\n");
-			if (!out_bufsz) {
-				struct iovec iov = { arg, sizeof(fmt) };
-				fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
-			} else {
-				fuse_reply_ioctl(req, 0, &fmt, sizeof(fmt));		
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_format), 1, 1, in_bufsz, out_bufsz)) {
+				struct v4l2_format fmt = dev.fmt;
+				fmt.type = ((const struct v4l2_format *)in_buf)->type;
+				fuse_reply_ioctl(req, 0, &fmt, sizeof(fmt));
 			}
 			break;
-			
+
 		case VIDIOC_S_FMT:
-			fprintf(stderr, "VIDIOC_S_FMT\n");
-			if (!in_bufsz || !out_bufsz) {
-				struct iovec iov_r = { arg, sizeof(fmt) };
-				struct iovec iov_w = { arg, sizeof(fmt) };
-				fuse_reply_ioctl_retry(req, &iov_r, 1, &iov_w, 1);
-			} else {
-				struct v4l2_format *in_fmt = (struct v4l2_format*)in_buf;
-				memcpy(&fmt, in_fmt, sizeof(fmt));
-				fuse_reply_ioctl(req, 0, &fmt, sizeof(fmt));		
-			}			
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_format), 1, 1, in_bufsz, out_bufsz)) {
+				struct v4l2_format fmt = *(const struct v4l2_format *)in_buf;
+				try_format(&fmt.fmt.pix);
+				if (pool_in_use() && fmt.fmt.pix.sizeimage > dev.fmt.fmt.pix.sizeimage) {
+					/* MMAP buffers are mapped by clients */
+					fuse_reply_err(req, EBUSY);
+				} else if (!pool_in_use() && pool_resize(fmt.fmt.pix.sizeimage) != 0) {
+					fuse_reply_err(req, ENOMEM);
+				} else {
+					if (memcmp(&fmt.fmt.pix, &dev.fmt.fmt.pix, sizeof(fmt.fmt.pix)) != 0) {
+						/* frames of the previous format are not given to readers */
+						for (struct client *it = dev.clients; it != NULL; it = it->next_client) {
+							it->next = dev.sequence;
+						}
+					}
+					dev.fmt = fmt;
+					fuse_reply_ioctl(req, 0, &dev.fmt, sizeof(dev.fmt));
+				}
+			}
 			break;
-			
+
+		case VIDIOC_G_PARM:
+		case VIDIOC_S_PARM:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_streamparm), 1, 1, in_bufsz, out_bufsz)) {
+				struct v4l2_streamparm parm = *(const struct v4l2_streamparm *)in_buf;
+				struct v4l2_fract *timeperframe = NULL;
+				if (parm.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+					timeperframe = &parm.parm.capture.timeperframe;
+				} else if (parm.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+					timeperframe = &parm.parm.output.timeperframe;
+				}
+				if (timeperframe == NULL) {
+					fuse_reply_err(req, EINVAL);
+					break;
+				}
+				if ((unsigned int)cmd == VIDIOC_S_PARM && timeperframe->numerator && timeperframe->denominator) {
+					dev.timeperframe = *timeperframe;
+				}
+				memset(&parm.parm, 0, sizeof(parm.parm));
+				if (parm.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+					parm.parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+					parm.parm.capture.timeperframe = dev.timeperframe;
+					parm.parm.capture.readbuffers = RING_SIZE;
+				} else {
+					parm.parm.output.capability = V4L2_CAP_TIMEPERFRAME;
+					parm.parm.output.timeperframe = dev.timeperframe;
+					parm.parm.output.writebuffers = RING_SIZE;
+				}
+				fuse_reply_ioctl(req, 0, &parm, sizeof(parm));
+			}
+			break;
+
+		case VIDIOC_REQBUFS:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_requestbuffers), 1, 1, in_bufsz, out_bufsz)) {
+				ioctl_reqbufs(req, c, (struct v4l2_requestbuffers *)in_buf);
+			}
+			break;
+
+		case VIDIOC_QUERYBUF:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_buffer), 1, 1, in_bufsz, out_bufsz)) {
+				ioctl_querybuf(req, c, in_buf);
+			}
+			break;
+
+		case VIDIOC_QBUF:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_buffer), 1, 1, in_bufsz, out_bufsz)) {
+				ioctl_qbuf(req, c, arg, in_buf, in_bufsz);
+			}
+			break;
+
+		case VIDIOC_DQBUF:
+			if (ioctl_arg(req, arg, sizeof(struct v4l2_buffer), 1, 1, in_bufsz, out_bufsz)) {
+				ioctl_dqbuf(req, c, arg, in_buf, out_bufsz);
+			}
+			break;
+
+		case VIDIOC_STREAMON:
+		case VIDIOC_STREAMOFF:
+			if (ioctl_arg(req, arg, sizeof(int), 1, 0, in_bufsz, out_bufsz)) {
+				int type = *(const int *)in_buf;
+				if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+					c->streaming = ((unsigned int)cmd == VIDIOC_STREAMON);
+					if (c->streaming) {
+						/* start with the next frame */
+						c->next = dev.sequence;
+					} else {
+						memset(&c->queued, 0, sizeof(c->queued));
+						if (c->pending && !c->pending_size) {
+							fuse_reply_err(c->pending, EINVAL);
+							c->pending = NULL;
+						}
+					}
+				}
+				fuse_reply_ioctl(req, 0, NULL, 0);
+			}
+			break;
+
 		default:
 			fuse_reply_err(req, EINVAL);
 			break;
 	}
+	pthread_mutex_unlock(&dev.lock);
 }
 
 static struct cuse_lowlevel_ops v4l2_oper = {
 	.open		= v4l2_open,
 	.read		= v4l2_read,
 	.write		= v4l2_write,
+	.release	= v4l2_release,
 	.ioctl		= v4l2_ioctl,
+	.poll		= v4l2_poll,
 };
 
 int main(int argc, char *argv[])
@@ -114,6 +848,24 @@ int main(int argc, char *argv[])
 	const char *dev_info_argv[] = { dev_name };
 	struct cuse_info ci;
 
+	memset(&dev, 0, sizeof(dev));
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&dev.lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	dev.fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	dev.fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	dev.fmt.fmt.pix.width = 320;
+	dev.fmt.fmt.pix.height = 200;
+	try_format(&dev.fmt.fmt.pix);
+	dev.timeperframe.numerator = 1;
+	dev.timeperframe.denominator = 25;
+
+	if (pool_open(strchr(dev_name, '=') + 1) != 0) {
+		return 1;
+	}
+
 	memset(&ci, 0, sizeof(ci));
 	ci.dev_major = 0;
 	ci.dev_minor = 0;
@@ -121,5 +873,14 @@ int main(int argc, char *argv[])
 	ci.dev_info_argv = dev_info_argv;
 	ci.flags = CUSE_UNRESTRICTED_IOCTL;
 
-	return cuse_lowlevel_main(args.argc, args.argv, &ci, &v4l2_oper, NULL);
+	int multithreaded = 0;
+	struct fuse_session *se = cuse_lowlevel_setup(args.argc, args.argv, &ci, &v4l2_oper, &multithreaded, NULL);
+	if (se == NULL) {
+		shm_unlink(dev.pool.name);
+		return 1;
+	}
+	int ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+	cuse_lowlevel_teardown(se);
+	shm_unlink(dev.pool.name);
+	return ret ? 1 : 0;
 }
@@ -16,8 +16,10 @@
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <time.h>
 
 #include <fstream>
+#include <sstream>
 
 #include "logger.h"
 
@@ -25,26 +27,27 @@
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
 
-int stop=0;
+#include "patterngenerator.h"
+
+#ifdef HAVE_JPEG
+#include "jpegencoder.h"
 
+// keep encoded frames in memory
+class MemorySink : public Sink {
+    public:
+        MemorySink(int format, int width, int height) : Sink(format, width, height) {}
 
-int getFrame(char buffer[], int bufSize, int width, int height, int i)
-{
-    for(int y=0;y<height;y++) {
-        for(int x=0;x<width;x++) {
-            /* Y */
-            buffer[ (y * width + x)*2 ] = x + y + i * 3;
-	    if ( (y * width + x) % 2 == 0) {	
-		/* U */
-		buffer[ (y * width + x)*2+1] = 128 + y + i * 2;
-	    } else {
-		/* V */
-		buffer[ (y * width + x)*2+1] = 64 + x + i * 5;
-	    }
+        virtual int write(const char* buffer, unsigned int size, const FrameInfo &) {
+                m_frames.push_back(std::string(buffer, size));
+                return size;
         }
-    }
-    return bufSize;
-}
+
+        std::vector<std::string> m_frames;
+};
+#endif
+
+int stop=0;
+
 /* ---------------------------------------------------------------------------
 **  SIGINT handler
 ** -------------------------------------------------------------------------*/
@@ -65,9 +68,11 @@ int main(int argc, char* argv[])
     	int width = 640;
     	int height = 480;
 	int fps = 25;
+	std::string pattern = "bars,box,counter,stamp";
+	std::string strformat = "YUYV";
 	
 	int c = 0;
-	while ((c = getopt (argc, argv, "hP:F:v::w" "W:H:F:")) != -1)
+	while ((c = getopt (argc, argv, "hP:F:v::w" "W:H:F:f:")) != -1)
 	{
 		switch (c)
 		{
@@ -77,15 +82,20 @@ int main(int argc, char* argv[])
 			case 'W':	width = atoi(optarg); break;
 			case 'H':	height = atoi(optarg); break;
 			case 'F':	fps = atoi(optarg); break;			
+			case 'P':	pattern = optarg; break;
+			case 'f':	strformat = optarg; break;
 			
 			case 'h':
 			{
-				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
+				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] [-F fps] [-f format] [-P pattern] dest_device" << std::endl;
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -W width      : V4L2 capture width (default "<< width << ")" << std::endl;
 				std::cout << "\t -H height     : V4L2 capture height (default "<< height << ")" << std::endl;
-				std::cout << "\t -F fps        : V4L2 capture framerate (default "<< fps << ")" << std::endl;				
+				std::cout << "\t -F fps        : V4L2 capture framerate (default "<< fps << "), 0 generates frames as fast as possible" << std::endl;				
+				std::cout << "\t -f format     : YUYV, UYVY, NV12, YU12 (I420), RGB3 (RGB24) or MJPG (default "<< strformat << ")" << std::endl;
+				std::cout << "\t -P pattern    : comma separated list of " << PatternGenerator::getPatterns() << " (default "<< pattern << ")" << std::endl;
+				std::cout << "\t                 MJPG frames are encoded once for a loop of one second of frames, the stamp is in a COM marker" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t dest_device   : V4L2 capture device (default "<< out_devname << ")" << std::endl;
 				exit(0);
@@ -102,7 +112,9 @@ int main(int argc, char* argv[])
 	initLogger(verbose);
 
 	// init V4L2 output interface
-	V4L2DeviceParameters outparam(out_devname, V4L2_PIX_FMT_YUYV, width, height, fps, ioTypeOut, verbose);
+	int format = V4l2Device::fourcc(strformat.c_str());
+	bool mjpeg = (format == V4L2_PIX_FMT_MJPEG) || (format == V4L2_PIX_FMT_JPEG);
+	V4L2DeviceParameters outparam(out_devname, format, width, height, fps, ioTypeOut, verbose);
 	V4l2Output* videoOutput = V4l2Output::create(outparam);
 	if (videoOutput == NULL)
 	{	
@@ -110,25 +122,127 @@ int main(int argc, char* argv[])
 	}
 	else
 	{		
+		// MJPEG frames are encoded from I420 patterns
+		width = videoOutput->getWidth();
+		height = videoOutput->getHeight();
+		if (mjpeg)
+		{
+			// the COM marker carries the stamp of the replayed frames, a barcode would freeze the stamp of the encoding
+			std::istringstream is(pattern);
+			std::string item;
+			std::string overlays;
+			while (std::getline(is, item, ','))
+			{
+				if (item != "stamp")
+				{
+					overlays += (overlays.empty() ? "" : ",") + item;
+				}
+			}
+			pattern = overlays;
+		}
+		PatternGenerator generator(mjpeg ? V4L2_PIX_FMT_YUV420 : videoOutput->getFormat(), width, height, pattern);
+		std::vector<std::string> jpegFrames;
+		std::string jpegFrame;
+		if (!generator.isValid() || (!mjpeg && (generator.getSize() > videoOutput->getBufferSize())))
+		{
+			LOG(WARN) << "Cannot generate pattern:" << pattern << " for " << V4l2Device::fourcc(videoOutput->getFormat()) << " " << width << "x" << height;
+			stop=1;
+		}
+		else if (mjpeg)
+		{
+#ifdef HAVE_JPEG
+			// encode once a loop of frames, they are replayed
+			MemorySink memorySink(V4L2_PIX_FMT_JPEG, generator.getWidth(), generator.getHeight());
+			std::map<std::string,std::string> opt;
+			Codec* encoder = CodecFactory::get().Create(V4L2_PIX_FMT_JPEG, V4L2_PIX_FMT_YUV420, generator.getWidth(), generator.getHeight(), opt, verbose);
+			if (encoder == NULL)
+			{
+				LOG(WARN) << "Cannot create JPEG encoder " << generator.getWidth() << "x" << generator.getHeight();
+				stop=1;
+			}
+			else
+			{
+				unsigned int loop = (fps > 0) ? fps : 25;
+				for (unsigned int j=0; j<loop; ++j)
+				{
+					encoder->convertAndWrite(generator.getFrame(j), generator.getSize(), &memorySink);
+				}
+				delete encoder;
+				jpegFrames.swap(memorySink.m_frames);
+				LOG(NOTICE) << "Encoded " << jpegFrames.size() << " MJPEG frames";
+			}
+#endif
+			if (jpegFrames.empty())
+			{
+				LOG(WARN) << "Cannot encode MJPEG frames";
+				stop=1;
+			}
+		}
+		
 		LOG(NOTICE) << "Start generating frames to " << out_devname; 
 		signal(SIGINT,sighandler);				
-		int i=0;
-		int picture_size = videoOutput->getBufferSize();
-		char buffer[picture_size]; 
+		unsigned int i=0;
+		
+		// frames are paced on absolute deadlines so that generation time does not drift the rate
+		const long long period = (fps > 0) ? 1000000000LL/fps : 0;
+		timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		timespec reportTime = deadline;
+		unsigned int reportCount = 0;
+		unsigned int late = 0;
 		
 		while (!stop) 
 		{
-			int rsize = getFrame(buffer, sizeof(buffer), width, height, i++);
-			if (rsize == -1)
+			const char* buffer = NULL;
+			int rsize = 0;
+			if (mjpeg)
 			{
-				LOG(NOTICE) << "stop " << strerror(errno); 
-				stop=1;					
+				// COM marker with the stamp after SOI
+				const std::string & jpeg = jpegFrames[i % jpegFrames.size()];
+				uint8_t com[4 + FrameStamp::payloadSize] = { 0xff, 0xfe, 0, 2 + FrameStamp::payloadSize };
+				FrameStamp(i, FrameStamp::now()).serialize(com + 4);
+				jpegFrame.assign(jpeg, 0, 2);
+				jpegFrame.append((const char*)com, sizeof(com));
+				jpegFrame.append(jpeg, 2, std::string::npos);
+				buffer = jpegFrame.c_str();
+				rsize = jpegFrame.size();
 			}
 			else
 			{
-				int wsize = videoOutput->write(buffer, rsize);
-				LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
-				usleep(1000000/fps);
+				buffer = generator.getFrame(i, FrameStamp(i, FrameStamp::now()));
+				rsize = generator.getSize();
+			}
+			i++;
+			int wsize = videoOutput->write((char*)buffer, rsize);
+			LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
+			reportCount++;
+			
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (period > 0)
+			{
+				deadline.tv_nsec += period;
+				while (deadline.tv_nsec >= 1000000000L) {
+					deadline.tv_nsec -= 1000000000L;
+					deadline.tv_sec++;
+				}
+				long long lateness = (now.tv_sec - deadline.tv_sec)*1000000000LL + (now.tv_nsec - deadline.tv_nsec);
+				if (lateness > period) {
+					// more than one frame late, restart the schedule instead of bursting
+					late++;
+					deadline = now;
+				} else {
+					while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR && !stop) {}
+				}
+			}
+			
+			double elapsed = (now.tv_sec - reportTime.tv_sec) + (now.tv_nsec - reportTime.tv_nsec)/1e9;
+			if (elapsed >= 1.0)
+			{
+				LOG(NOTICE) << "fps:" << (reportCount/elapsed) << " late:" << late; 
+				reportTime = now;
+				reportCount = 0;
+				late = 0;
 			}
 		}
 		delete videoOutput;